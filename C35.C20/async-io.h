@@ -0,0 +1,403 @@
+/**********************************************************
+ * This header defines an AsyncFile, which reads or       *
+ * writes a regular file sequentially through a few large *
+ * chunks kept in flight at once. Reads are submitted for *
+ * the chunks ahead of the one being consumed, and a full *
+ * chunk is written while the next one fills. On Linux it *
+ * drives io_uring directly through its system calls,     *
+ * with the chunks registered as fixed buffers; where     *
+ * io_uring is not available it falls back to `pread` and *
+ * `pwrite`, with `posix_fadvise` readahead hints. An     *
+ * AsyncFile must only be used by one thread.             *
+ **********************************************************/
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#define encrypt encrypt_unistd
+#include <unistd.h>
+#undef encrypt
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#define ASYNC_CHUNKS 4
+#define ASYNC_CHUNK_SIZE (256 << 10)
+
+typedef struct {
+  int fd;
+  int writing;
+  char *mem;
+  // Bytes in each chunk: read so far, or filled for writing
+  int len[ASYNC_CHUNKS];
+  // Submitted to io_uring and not yet completed
+  int busy[ASYNC_CHUNKS];
+  // File offset each chunk was submitted at
+  long long at[ASYNC_CHUNKS];
+  int cur;
+  int pos;
+  long long offset;
+  int error;
+  // The io_uring instance, or -1 when using pread/pwrite
+  int ring;
+  // Set once waiting on the ring fails; later chunks use pread/pwrite
+  int ring_failed;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+#ifdef __linux__
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+#endif
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  size_t sqes_size;
+} AsyncFile;
+
+/**
+ * Read into `buf` from offset `at` until `n` bytes have been read
+ * or the file ends. Returns how many were read, or -1 on an error.
+ */
+int async_pread_full(int fd, char *buf, int n, long long at) {
+  int done = 0;
+  while (done < n) {
+    ssize_t got = pread(fd, buf + done, n - done, at + done);
+    if (got < 0) {
+      return -1;
+    }
+    if (got == 0) {
+      break;
+    }
+    done += got;
+  }
+  return done;
+}
+
+/**
+ * Write all `n` bytes at `buf` at offset `at`. Returns 0, or -1 on
+ * an error.
+ */
+int async_pwrite_full(int fd, const char *buf, int n, long long at) {
+  int done = 0;
+  while (done < n) {
+    ssize_t put = pwrite(fd, buf + done, n - done, at + done);
+    if (put <= 0) {
+      return -1;
+    }
+    done += put;
+  }
+  return 0;
+}
+
+/**
+ * Read or write chunk `i` (`len` bytes, or as many as the file
+ * holds when reading) at once with pread/pwrite.
+ */
+void async_sync(AsyncFile *af, int i, int len) {
+  char *chunk = af->mem + (size_t) i * ASYNC_CHUNK_SIZE;
+  if (af->writing) {
+    af->error |= async_pwrite_full(af->fd, chunk, len, af->at[i]) != 0;
+    return;
+  }
+  int got = async_pread_full(af->fd, chunk, len, af->at[i]);
+  af->len[i] = got > 0 ? got : 0;
+  af->error |= got < 0;
+}
+
+#ifdef __linux__
+/**
+ * Set up an io_uring for `af` and register its chunks as fixed
+ * buffers. Returns 0, or -1 (with nothing left open) if the kernel
+ * does not allow it.
+ */
+int async_ring_open(AsyncFile *af) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  af->ring = syscall(__NR_io_uring_setup, ASYNC_CHUNKS, &p);
+  if (af->ring < 0) {
+    return -1;
+  }
+  af->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  af->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  af->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  af->sq_ptr = mmap(NULL, af->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, af->ring,
+                    IORING_OFF_SQ_RING);
+  af->cq_ptr = mmap(NULL, af->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, af->ring,
+                    IORING_OFF_CQ_RING);
+  af->sqes = mmap(NULL, af->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, af->ring,
+                  IORING_OFF_SQES);
+  struct iovec iov[ASYNC_CHUNKS];
+  for (int i = 0; i < ASYNC_CHUNKS; i++) {
+    iov[i].iov_base = af->mem + (size_t) i * ASYNC_CHUNK_SIZE;
+    iov[i].iov_len = ASYNC_CHUNK_SIZE;
+  }
+  if (af->sq_ptr == MAP_FAILED || af->cq_ptr == MAP_FAILED || af->sqes == MAP_FAILED ||
+      syscall(__NR_io_uring_register, af->ring, IORING_REGISTER_BUFFERS, iov, ASYNC_CHUNKS) != 0) {
+    if (af->sq_ptr != MAP_FAILED) {
+      munmap(af->sq_ptr, af->sq_size);
+    }
+    if (af->cq_ptr != MAP_FAILED) {
+      munmap(af->cq_ptr, af->cq_size);
+    }
+    if (af->sqes != MAP_FAILED) {
+      munmap(af->sqes, af->sqes_size);
+    }
+    close(af->ring);
+    af->ring = -1;
+    return -1;
+  }
+  char *sq = af->sq_ptr, *cq = af->cq_ptr;
+  af->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  af->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  af->sq_array = (unsigned *) (sq + p.sq_off.array);
+  af->cq_head = (unsigned *) (cq + p.cq_off.head);
+  af->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  af->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  af->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+/**
+ * Submit a fixed-buffer read or write of `len` bytes of chunk `i`
+ * at file offset `at`. Never more than ASYNC_CHUNKS are in flight,
+ * so the submission queue always has room. If the kernel does not
+ * take the entry, it is withdrawn from the queue (only this thread
+ * submits) and the chunk is done at once with pread/pwrite.
+ */
+void async_ring_submit(AsyncFile *af, int i, int len, long long at) {
+  unsigned tail = *af->sq_tail;
+  unsigned idx = tail & *af->sq_mask;
+  struct io_uring_sqe *sqe = &af->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = af->writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+  sqe->fd = af->fd;
+  sqe->addr = (unsigned long) (af->mem + (size_t) i * ASYNC_CHUNK_SIZE);
+  sqe->len = len;
+  sqe->off = at;
+  sqe->buf_index = i;
+  sqe->user_data = i;
+  af->sq_array[idx] = idx;
+  __atomic_store_n(af->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  long submitted;
+  do {
+    submitted = syscall(__NR_io_uring_enter, af->ring, 1, 0, 0, NULL, 0);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted != 1) {
+    __atomic_store_n(af->sq_tail, tail, __ATOMIC_RELEASE);
+    af->busy[i] = 0;
+    async_sync(af, i, len);
+  }
+}
+
+/**
+ * Wait for one completion and record its result in its chunk. If
+ * the wait itself fails (other than being interrupted), every chunk
+ * in flight is marked failed and read as empty, and the ring is not
+ * used again.
+ */
+void async_ring_reap(AsyncFile *af) {
+  unsigned head = *af->cq_head;
+  while (head == __atomic_load_n(af->cq_tail, __ATOMIC_ACQUIRE)) {
+    if (syscall(__NR_io_uring_enter, af->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR) {
+      for (int i = 0; i < ASYNC_CHUNKS; i++) {
+        if (af->busy[i]) {
+          af->busy[i] = 0;
+          af->len[i] = 0;
+        }
+      }
+      af->error = 1;
+      af->ring_failed = 1;
+      return;
+    }
+  }
+  struct io_uring_cqe *cqe = &af->cqes[head & *af->cq_mask];
+  int i = cqe->user_data;
+  int res = cqe->res;
+  __atomic_store_n(af->cq_head, head + 1, __ATOMIC_RELEASE);
+  af->busy[i] = 0;
+  if (res < 0) {
+    af->error = 1;
+    res = 0;
+  }
+  // Finish a short transfer synchronously; a short read only means
+  // end of file once pread returns nothing more
+  char *chunk = af->mem + (size_t) i * ASYNC_CHUNK_SIZE;
+  if (af->writing && res < af->len[i]) {
+    af->error |= async_pwrite_full(af->fd, chunk + res, af->len[i] - res, af->at[i] + res) != 0;
+  } else if (!af->writing) {
+    int more = 0;
+    if (res > 0 && res < ASYNC_CHUNK_SIZE) {
+      more = async_pread_full(af->fd, chunk + res, ASYNC_CHUNK_SIZE - res, af->at[i] + res);
+      af->error |= more < 0;
+    }
+    af->len[i] = res + (more > 0 ? more : 0);
+  }
+}
+#endif
+
+/**
+ * Start reading or writing chunk `i` at the current offset: through
+ * io_uring, or at once with pread/pwrite (hinting the kernel to read
+ * ahead the chunks after it).
+ */
+void async_submit(AsyncFile *af, int i, int len) {
+  af->at[i] = af->offset;
+  af->offset += len;
+  if (af->writing) {
+    af->len[i] = len;
+  }
+#ifdef __linux__
+  if (af->ring >= 0 && !af->ring_failed) {
+    af->busy[i] = 1;
+    async_ring_submit(af, i, len, af->at[i]);
+    return;
+  }
+#endif
+  async_sync(af, i, len);
+  if (af->writing) {
+    return;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(af->fd, af->offset, (long long) (ASYNC_CHUNKS - 1) * ASYNC_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/**
+ * Wait until chunk `i` is no longer in flight.
+ */
+void async_wait(AsyncFile *af, int i) {
+#ifdef __linux__
+  while (af->busy[i]) {
+    async_ring_reap(af);
+  }
+#endif
+}
+
+/**
+ * Open an AsyncFile on the descriptor `fd` of a regular file, for
+ * writing if `writing` is set and for reading otherwise, starting at
+ * offset 0. Reads are submitted for every chunk straight away.
+ * Returns NULL if out of memory.
+ */
+AsyncFile *async_open(int fd, int writing) {
+  AsyncFile *af = calloc(1, sizeof(AsyncFile));
+  if (af == NULL) {
+    return NULL;
+  }
+  af->mem = mmap(NULL, (size_t) ASYNC_CHUNKS * ASYNC_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (af->mem == MAP_FAILED) {
+    free(af);
+    return NULL;
+  }
+  af->fd = fd;
+  af->writing = writing;
+  af->ring = -1;
+#ifdef __linux__
+  async_ring_open(af);
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (!writing) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+#endif
+  if (!writing) {
+    for (int i = 0; i < ASYNC_CHUNKS; i++) {
+      async_submit(af, i, ASYNC_CHUNK_SIZE);
+    }
+  }
+  return af;
+}
+
+/**
+ * Whether `af` is using io_uring rather than pread/pwrite.
+ */
+int async_uring(AsyncFile *af) {
+  return af->ring >= 0 && !af->ring_failed;
+}
+
+/**
+ * Copy up to `n` of the next characters of the file into `buf`.
+ * Returns how many, or 0 at end of file (or on a read error).
+ */
+int async_read(AsyncFile *af, char *buf, int n) {
+  while (1) {
+    async_wait(af, af->cur);
+    int left = af->len[af->cur] - af->pos;
+    if (left > 0) {
+      int k = n < left ? n : left;
+      memcpy(buf, af->mem + (size_t) af->cur * ASYNC_CHUNK_SIZE + af->pos, k);
+      af->pos += k;
+      return k;
+    }
+    if (af->len[af->cur] < ASYNC_CHUNK_SIZE) {
+      return 0;
+    }
+    // The chunk is used up: refill it with the next chunk's worth
+    // of the file and move on to the one after it
+    async_submit(af, af->cur, ASYNC_CHUNK_SIZE);
+    af->cur = (af->cur + 1) % ASYNC_CHUNKS;
+    af->pos = 0;
+  }
+}
+
+/**
+ * Append the `n` characters at `buf` to the file, submitting each
+ * chunk as it fills and waiting only for the oldest write when all
+ * the chunks are in flight.
+ */
+void async_write(AsyncFile *af, const char *buf, int n) {
+  while (n > 0) {
+    int k = ASYNC_CHUNK_SIZE - af->pos;
+    k = n < k ? n : k;
+    memcpy(af->mem + (size_t) af->cur * ASYNC_CHUNK_SIZE + af->pos, buf, k);
+    af->pos += k;
+    buf += k;
+    n -= k;
+    if (af->pos == ASYNC_CHUNK_SIZE) {
+      async_submit(af, af->cur, ASYNC_CHUNK_SIZE);
+      af->cur = (af->cur + 1) % ASYNC_CHUNKS;
+      af->pos = 0;
+      async_wait(af, af->cur);
+    }
+  }
+}
+
+/**
+ * Write out the last partial chunk, wait for everything in flight
+ * and free `af`. Returns 0, or -1 if any read or write failed.
+ */
+int async_close(AsyncFile *af) {
+  if (af->writing && af->pos > 0) {
+    async_submit(af, af->cur, af->pos);
+  }
+  for (int i = 0; i < ASYNC_CHUNKS; i++) {
+    async_wait(af, i);
+  }
+  int error = af->error;
+#ifdef __linux__
+  if (af->ring >= 0) {
+    munmap(af->sq_ptr, af->sq_size);
+    munmap(af->cq_ptr, af->cq_size);
+    munmap(af->sqes, af->sqes_size);
+    close(af->ring);
+  }
+#endif
+  munmap(af->mem, (size_t) ASYNC_CHUNKS * ASYNC_CHUNK_SIZE);
+  free(af);
+  return error ? -1 : 0;
+}
+
+#endif // ASYNC_IO_H
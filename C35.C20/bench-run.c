@@ -0,0 +1,56 @@
+/**********************************************************
+ * Runs a command, feeding it the file given as its       *
+ * standard input, and prints its resource use as one     *
+ * line of key=value pairs: wall, user and system time in *
+ * seconds, voluntary and involuntary context switches,   *
+ * peak RSS in KB and the exit status.                    *
+ * Usage: `bench-run <stdin_file> <command> [args...]`    *
+ **********************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: bench-run <stdin_file> <command> [args...]\n");
+    return 1;
+  }
+
+  double start = seconds();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int in = open(argv[1], O_RDONLY);
+    int out = open("/dev/null", O_WRONLY);
+    if (in < 0 || out < 0) {
+      _exit(126);
+    }
+    dup2(in, 0);
+    dup2(out, 1);
+    execv(argv[2], &argv[2]);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage ru;
+  if (pid < 0 || wait4(pid, &status, 0, &ru) < 0) {
+    perror("bench-run");
+    return 1;
+  }
+  double wall = seconds() - start;
+
+  printf("wall_s=%.6f user_s=%.6f sys_s=%.6f vcsw=%ld ivcsw=%ld maxrss_kb=%ld status=%d\n",
+         wall, ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+         ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_nvcsw, ru.ru_nivcsw,
+         ru.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+  return 0;
+}
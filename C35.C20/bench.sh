@@ -0,0 +1,59 @@
+#!/bin/sh
+# End-to-end throughput benchmark. For every input size and byte
+# distribution it generates an input with gen-input, makes a
+# reference run, then runs encrypt for every buffer size pair and
+# mode, printing one CSV line per run with the throughput, wall and
+# CPU time, context switches, resets (log blocks after the first)
+# and whether the output and log match the reference run.
+#
+# Settings come from the environment (separate modes with `|`):
+#   SIZES    input sizes, K/M/G suffixes allowed  (1K 64K 1M 8M)
+#   DISTS    text binary runs skewed              (text binary runs)
+#   BUFFERS  input:output buffer size pairs       (64:64 4096:4096 65536:65536)
+#   MODES    encrypt options, `default` for none  (default|-e|-e -m|-j 4|-p 4)
+#   REF      options for the reference run        (-p 1)
+#
+# Usage: ./bench.sh > bench.csv
+
+SIZES=${SIZES:-"1K 64K 1M 8M"}
+DISTS=${DISTS:-"text binary runs"}
+BUFFERS=${BUFFERS:-"64:64 4096:4096 65536:65536"}
+MODES=${MODES:-"default|-e|-e -m|-j 4|-p 4"}
+REF=${REF:-"-p 1"}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "size,dist,in_buf,out_buf,mode,wall_s,user_s,sys_s,vcsw,ivcsw,maxrss_kb,MBps,resets,identical,status"
+for size in $SIZES; do
+  for dist in $DISTS; do
+    ./gen-input "$dist" "$size" > "$dir/in"
+    bytes=$(wc -c < "$dir/in")
+    printf '4096\n4096\n' > "$dir/sizes"
+    ./bench-run "$dir/sizes" ./encrypt $REF "$dir/in" "$dir/ref.out" "$dir/ref.log" > /dev/null
+
+    for pair in $BUFFERS; do
+      printf '%s\n%s\n' "${pair%%:*}" "${pair##*:}" > "$dir/sizes"
+      echo "$MODES" | tr '|' '\n' | while read -r mode; do
+        flags=$mode
+        [ "$mode" = default ] && flags=
+        stats=$(./bench-run "$dir/sizes" ./encrypt $flags "$dir/in" "$dir/out" "$dir/log")
+        identical=1
+        cmp -s "$dir/out" "$dir/ref.out" && cmp -s "$dir/log" "$dir/ref.log" || identical=0
+        resets=$(($(grep -c '^Counts using key' "$dir/log") - 1))
+        echo "$stats" | awk -v size="$bytes" -v dist="$dist" -v pair="$pair" -v mode="$mode" \
+            -v resets="$resets" -v identical="$identical" '{
+          for (i = 1; i <= NF; i++) { split($i, kv, "="); s[kv[1]] = kv[2] }
+          split(pair, b, ":")
+          printf "%d,%s,%d,%d,%s,%s,%s,%s,%s,%s,%s,%.2f,%d,%d,%s\n", size, dist, b[1], b[2], mode,
+                 s["wall_s"], s["user_s"], s["sys_s"], s["vcsw"], s["ivcsw"], s["maxrss_kb"],
+                 size / s["wall_s"] / 1e6, resets, identical, s["status"]
+        }'
+        [ "$identical" = 1 ] || echo "mismatch: size=$bytes dist=$dist buffers=$pair mode=$mode" >&2
+      done
+    done
+  done
+done 2> "$dir/errors"
+
+cat "$dir/errors" >&2
+[ ! -s "$dir/errors" ]
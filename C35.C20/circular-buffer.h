@@ -3,53 +3,355 @@
  * used for the input and output buffers. It contains a   *
  * dynamically allocated character array, a size value,   *
  * head and tail indexes, a mutex for synchronization,    *
- * and semaphores to coordinate producers and consumers.  *
- **********************************************************/ 
+ * and condition variables to coordinate producers and    *
+ * consumers. Items are moved in contiguous spans so that *
+ * a whole run of slots costs one synchronization round.  *
+ * Passing NULL items moves only the indexes, for callers *
+ * that keep the data elsewhere (the mapped file mode).   *
+ * Every item put is read by each of the buffer's         *
+ * consumers (as many as given to `cb_init`), and its     *
+ * slot is freed once the slowest of them has read it.    *
+ * Building with `-DCB_LOCKFREE` swaps in a lock-free     *
+ * variant with the same functions, for A/B comparison.   *
+ * Waits for space or data follow the policy selected in  *
+ * `wait-policy.h`.                                       *
+ **********************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include "wait-policy.h"
+
+/**
+ * Most consumers a buffer can have; each consumer reads every item,
+ * so a tap such as a checksum needs no copy of the data of its own.
+ */
+#ifndef CB_MAX_CONSUMERS
+#define CB_MAX_CONSUMERS 4
+#endif
+
+/**
+ * Check the arguments of `cb_init`. Returns 0, or -1 after printing
+ * why they are invalid.
+ */
+int cb_check(int buffer_size, int consumers) {
+    if (buffer_size < 1) {
+        printf("Buffer size must be at least 1\n");
+        return -1;
+    }
+    if (consumers < 1 || consumers > CB_MAX_CONSUMERS) {
+        printf("Buffer must have between 1 and %d consumers\n", CB_MAX_CONSUMERS);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef CB_LOCKFREE
+#include <stdatomic.h>
+
+#define CB_CACHE_LINE 64
+
+/**
+ * One ring index on its own cache line, together with the owner's
+ * cached copy of the index it waits on. The producer owns `tail`
+ * and caches the slower head; each consumer owns its `head` and
+ * caches the tail, so the shared lines are only touched when the
+ * cached value says the ring looks full or empty. Peers that park
+ * waiting for this index to move sleep on `seq`, and register in
+ * `waiters` so the owner only makes the wake syscall when needed.
+ */
+typedef struct {
+    _Alignas(CB_CACHE_LINE) atomic_size_t pos;  // Monotonic position, slot is pos % size
+    size_t cached;                              // Owner's last view of the peer index
+    atomic_uint seq;                            // Futex word bumped to wake parked peers
+    atomic_int waiters;                         // Number of peers parked on `seq`
+    WaitState wait;                             // Owner's state when waiting on a peer
+} CBIndex;
+
+/**
+ * Initialize a ring index at position 0.
+ */
+void cb_index_init(CBIndex *ix) {
+    atomic_init(&ix->pos, 0);
+    ix->cached = 0;
+    atomic_init(&ix->seq, 0);
+    atomic_init(&ix->waiters, 0);
+    ws_init(&ix->wait);
+}
+
+/** Lock-free Circular Buffer Structure
+ * A single-producer / multi-consumer broadcast ring. The producer
+ * publishes a span by storing `tail` with release ordering and
+ * each consumer frees its span by storing its own `head` the same
+ * way, so no mutex is needed. Free space is measured against the
+ * slowest of the `consumers` heads.
+ */
+typedef struct {
+    char *buffer;      // Actual buffer to store characters
+    int size;          // Total size of the buffer
+    int consumers;     // Number of consumers reading every item
+    atomic_int closed; // Set once the producer has put its last item
+
+    CBIndex tail;      // Index to write to
+    CBIndex head[CB_MAX_CONSUMERS]; // Index to read from, one for each consumer
+} CircularBuffer;
+
+/**
+ * Initialize the CircularBuffer at `cb` with size `buffer_size`,
+ * to be read by `consumers` consumers with ids `0..consumers-1`.
+ */
+int cb_init(CircularBuffer *cb, int buffer_size, int consumers) {
+    if (cb_check(buffer_size, consumers) != 0) {
+        return -1;
+    }
+
+    // Allocate buffer
+    cb->buffer = (char*) malloc(buffer_size * sizeof(char));
+    if (cb->buffer == NULL) {
+        printf("Buffer memory allocation failed\n");
+        return -1;  // Memory allocation failed
+    }
+
+    // Initialize buffer properties
+    cb->size = buffer_size;
+    cb->consumers = consumers;
+    atomic_init(&cb->closed, 0);
+    cb_index_init(&cb->tail);
+    for (int i = 0; i < consumers; i++) {
+        cb_index_init(&cb->head[i]);
+    }
+
+    return 0;
+}
+
+/**
+ * Wake any peers parked on `ix` after its owner moved it.
+ * The fence orders the index store before the `waiters` check,
+ * pairing with the waiter registering before it re-checks.
+ */
+void cb_notify(CBIndex *ix) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ix->waiters, memory_order_relaxed) > 0) {
+        wp_wake(&ix->seq);
+    }
+}
+
+/**
+ * Return the slowest consumer's head, loaded with acquire ordering
+ * so its reads of the slots before it are finished.
+ */
+CBIndex *cb_slowest(CircularBuffer *cb, size_t *pos) {
+    CBIndex *slow = &cb->head[0];
+    *pos = atomic_load_explicit(&slow->pos, memory_order_acquire);
+    for (int i = 1; i < cb->consumers; i++) {
+        size_t h = atomic_load_explicit(&cb->head[i].pos, memory_order_acquire);
+        if (h < *pos) {
+            *pos = h;
+            slow = &cb->head[i];
+        }
+    }
+    return slow;
+}
+
+/**
+ * Add `n` items from `items` to `cb`. Each round copies as many
+ * items as the slowest consumer has made room for (wrapping around
+ * the end of the array) and publishes them with one store to `tail`.
+ */
+int cb_put_n(CircularBuffer *cb, const char *items, int n) {
+    size_t tail = atomic_load_explicit(&cb->tail.pos, memory_order_relaxed);
+    int done = 0;
+
+    while (done < n) {
+        size_t free_slots = cb->size - (tail - cb->tail.cached);
+        if (free_slots == 0) {
+            // Refresh the slowest head
+            CBIndex *slow = cb_slowest(cb, &cb->tail.cached);
+            free_slots = cb->size - (tail - cb->tail.cached);
+            if (free_slots == 0) {
+                if (ws_step(&cb->tail.wait)) {
+                    // Park on the slowest consumer until it frees a slot
+                    atomic_fetch_add(&slow->waiters, 1);
+                    unsigned seen = atomic_load(&slow->seq);
+                    if (atomic_load(&slow->pos) == cb->tail.cached) {
+                        wp_park(&slow->seq, seen);
+                    }
+                    atomic_fetch_sub(&slow->waiters, 1);
+                }
+                continue;
+            }
+            ws_done(&cb->tail.wait);
+        }
+
+        int span = free_slots < (size_t) (n - done) ? (int) free_slots : n - done;
+        int slot = tail % cb->size;
+        int first = cb->size - slot;
+        if (first > span) {
+            first = span;
+        }
+        if (items != NULL) {
+            memcpy(cb->buffer + slot, items + done, first);
+            memcpy(cb->buffer, items + done + first, span - first);
+        }
+
+        tail += span;
+        atomic_store_explicit(&cb->tail.pos, tail, memory_order_release);
+        cb_notify(&cb->tail);
+        done += span;
+    }
+
+    return done;
+}
+
+/**
+ * Remove up to `max` items from `cb` into `items` for consumer
+ * `cid` (`0` to `consumers - 1`). Waits until at least one item is available
+ * and returns the number of items copied, or 0 once the buffer is
+ * closed and empty.
+ */
+int cb_get_n(CircularBuffer *cb, int cid, char *items, int max) {
+    CBIndex *self = &cb->head[cid];
+    size_t head = atomic_load_explicit(&self->pos, memory_order_relaxed);
+
+    while (self->cached == head) {
+        // Check `closed` before the tail so a final span is not missed
+        int closed = atomic_load_explicit(&cb->closed, memory_order_acquire);
+        self->cached = atomic_load_explicit(&cb->tail.pos, memory_order_acquire);
+        if (self->cached != head) {
+            break;
+        }
+        if (closed) {
+            ws_done(&self->wait);
+            return 0;
+        }
+        if (ws_step(&self->wait)) {
+            // Park until the producer publishes or closes
+            atomic_fetch_add(&cb->tail.waiters, 1);
+            unsigned seen = atomic_load(&cb->tail.seq);
+            if (atomic_load(&cb->tail.pos) == head && !atomic_load(&cb->closed)) {
+                wp_park(&cb->tail.seq, seen);
+            }
+            atomic_fetch_sub(&cb->tail.waiters, 1);
+        }
+    }
+    ws_done(&self->wait);
+
+    size_t avail = self->cached - head;
+    int span = avail < (size_t) max ? (int) avail : max;
+    int slot = head % cb->size;
+    int first = cb->size - slot;
+    if (first > span) {
+        first = span;
+    }
+    if (items != NULL) {
+        memcpy(items, cb->buffer + slot, first);
+        memcpy(items + first, cb->buffer, span - first);
+    }
+
+    atomic_store_explicit(&self->pos, head + span, memory_order_release);
+    cb_notify(self);
+
+    return span;
+}
+
+/**
+ * Number of items waiting for consumer `cid`, as a snapshot that
+ * may already be out of date (for statistics only).
+ */
+int cb_count(CircularBuffer *cb, int cid) {
+    return atomic_load_explicit(&cb->tail.pos, memory_order_relaxed)
+        - atomic_load_explicit(&cb->head[cid].pos, memory_order_relaxed);
+}
+
+/**
+ * Number of items the slowest consumer has not read yet, as a
+ * snapshot that may already be out of date (for statistics only).
+ */
+int cb_fill(CircularBuffer *cb) {
+    size_t tail = atomic_load_explicit(&cb->tail.pos, memory_order_relaxed);
+    size_t slowest = tail;
+    for (int i = 0; i < cb->consumers; i++) {
+        size_t h = atomic_load_explicit(&cb->head[i].pos, memory_order_relaxed);
+        if (h < slowest) {
+            slowest = h;
+        }
+    }
+    return tail - slowest;
+}
+
+/**
+ * Mark `cb` as closed after the producer's last item. Consumers
+ * drain whatever is left and then get a span of length 0.
+ */
+void cb_close(CircularBuffer *cb) {
+    atomic_store_explicit(&cb->closed, 1, memory_order_release);
+    cb_notify(&cb->tail);
+}
+
+/**
+ * Cleanup function to free allocated memory for `cb`.
+ */
+void cb_destroy(CircularBuffer *cb) {
+    free(cb->buffer);
+}
+
+#else
 
 /** Circular Buffer Structure
  * The CircularBuffer struct contains a pointer to a dynamically
  * allocated character array, an int value for the buffer size,
- * and head and tail indexes. It also includes a mutex for 
- * thread-safe access and semaphores to coordinate between
- * producers and consumers. Because the buffers will each
- * have one producer and two consumers, the `head` index and
- * both semaphore types are duplicated as arrays of length 2.
- */ 
+ * and head and tail indexes. It also includes a mutex for
+ * thread-safe access and condition variables to coordinate
+ * between producers and consumers. Because the buffers each have
+ * one producer and `consumers` consumers, the `head` index, the
+ * fill `count` and the `not_empty` condition are kept per consumer
+ * in arrays of length CB_MAX_CONSUMERS.
+ */
 typedef struct {
     char *buffer;      // Actual buffer to store characters
     int size;          // Total size of the buffer
-    // int count;         // Current number of elements in the buffer
-    int head[2];       // Index to read from, one for each consumer
+    int consumers;     // Number of consumers reading every item
+    int count[CB_MAX_CONSUMERS]; // Filled slots not yet read, one for each consumer
+    int head[CB_MAX_CONSUMERS];  // Index to read from, one for each consumer
     int tail;          // Index to write to
-    
+    int closed;        // Set once the producer has put its last item
+    WaitState put_wait;    // Producer's state when waiting for space
+    WaitState get_wait[CB_MAX_CONSUMERS]; // Consumers' state when waiting for items
+
     // Synchronization primitives
     pthread_mutex_t *mutex;       // Mutex for thread-safe access
-    sem_t *read[2];               // Semaphore to track empty slots for each consumer
-    sem_t *full[2];               // Semaphore to track filled slots for each consumer
+    pthread_cond_t *not_full;     // Signalled when a consumer frees slots
+    pthread_cond_t *not_empty[CB_MAX_CONSUMERS]; // Signalled when the producer fills slots
 } CircularBuffer;
 
 /**
- * Initialize the CircularBuffer at `cb` with size `buffer_size`
+ * Initialize the CircularBuffer at `cb` with size `buffer_size`,
+ * to be read by `consumers` consumers with ids `0..consumers-1`.
  */
-int cb_init(CircularBuffer *cb, int buffer_size) {
+int cb_init(CircularBuffer *cb, int buffer_size, int consumers) {
+    if (cb_check(buffer_size, consumers) != 0) {
+        return -1;
+    }
+
     // Allocate buffer
     cb->buffer = (char*) malloc(buffer_size * sizeof(char));
     if (cb->buffer == NULL) {
         printf("Buffer memory allocation failed\n");
         return -1;  // Memory allocation failed
     }
-    
+
     // Initialize buffer properties
     cb->size = buffer_size;
-    // cb->count = 0;
-    cb->head[0] = 0;
-    cb->head[1] = 0;
+    cb->consumers = consumers;
+    for (int i = 0; i < consumers; i++) {
+        cb->count[i] = 0;
+        cb->head[i] = 0;
+        ws_init(&cb->get_wait[i]);
+    }
     cb->tail = 0;
-    
+    cb->closed = 0;
+    ws_init(&cb->put_wait);
+
     cb->mutex = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
     // Initialize synchronization primitives
     if (pthread_mutex_init(cb->mutex, NULL) != 0) {
@@ -59,95 +361,227 @@ int cb_init(CircularBuffer *cb, int buffer_size) {
         return -1;
     }
 
-    cb->read[0] = sem_open("/sem_cb_read_1", O_CREAT, 0644, buffer_size);
-    sem_unlink("/sem_cb_read_1");
- 
-    cb->read[1] = sem_open("/sem_cb_read_2", O_CREAT, 0644, buffer_size);
-    sem_unlink("/sem_cb_read_2");
-
-    cb->full[0] = sem_open("/sem_cb_post_1", O_CREAT, 0644, 0);
-    sem_unlink("/sem_cb_post_1");
+    cb->not_full = (pthread_cond_t*) malloc(sizeof(pthread_cond_t));
+    pthread_cond_init(cb->not_full, NULL);
+    for (int i = 0; i < consumers; i++) {
+        cb->not_empty[i] = (pthread_cond_t*) malloc(sizeof(pthread_cond_t));
+        pthread_cond_init(cb->not_empty[i], NULL);
+    }
 
-    cb->full[1] = sem_open("/sem_cb_post_2", O_CREAT, 0644, 0);
-    sem_unlink("/sem_cb_post_2");
-    
     return 0;
 }
 
 /**
- * Add an item to `cb`. Waits for both `read` semaphores 
- * to ensure that both consumers have processed at least
- * one cell in the buffer and posts to both `full` semaphores 
- * to signal to both consumers that an item was added.
+ * Take one step of a wait on `cond` following the wait policy:
+ * spin or yield with `cb->mutex` released, or park on `cond` once
+ * the budgets are used up. The caller re-checks its condition.
+ * Must be called with `cb->mutex` held.
  */
-int cb_put(CircularBuffer *cb, char item) {
-    // Wait for an empty slot
-    sem_wait(cb->read[0]);
-    sem_wait(cb->read[1]);
-    
+void cb_wait(CircularBuffer *cb, WaitState *ws, pthread_cond_t *cond) {
+    if (ws->round >= ws->budget + wait_policy->yields) {
+        ws->round++;
+        pthread_cond_wait(cond, cb->mutex);
+        return;
+    }
+    pthread_mutex_unlock(cb->mutex);
+    ws_step(ws);
+    pthread_mutex_lock(cb->mutex);
+}
+
+/**
+ * Number of slots the slowest consumer has not read yet.
+ * Must be called with `cb->mutex` held.
+ */
+int cb_used(CircularBuffer *cb) {
+    int used = cb->count[0];
+    for (int i = 1; i < cb->consumers; i++) {
+        if (cb->count[i] > used) {
+            used = cb->count[i];
+        }
+    }
+    return used;
+}
+
+/**
+ * Add up to `n` items from `items` to `cb` in a single round.
+ * Waits until at least one slot has been read by every consumer,
+ * then copies as many items as fit (wrapping around the end of the
+ * array) and wakes the consumers. Returns the number of items put.
+ * Must be called with `cb->mutex` held.
+ */
+int cb_put_span(CircularBuffer *cb, const char *items, int n) {
+    // Wait for an empty slot; the slowest consumer decides how many are free
+    int used = cb_used(cb);
+    while (used == cb->size) {
+        cb_wait(cb, &cb->put_wait, cb->not_full);
+        used = cb_used(cb);
+    }
+    ws_done(&cb->put_wait);
+
+    int span = cb->size - used;
+    if (span > n) {
+        span = n;
+    }
+
+    // Copy the span, splitting it where it wraps around
+    int first = cb->size - cb->tail;
+    if (first > span) {
+        first = span;
+    }
+    if (items != NULL) {
+        memcpy(cb->buffer + cb->tail, items, first);
+        memcpy(cb->buffer, items + first, span - first);
+    }
+    cb->tail = (cb->tail + span) % cb->size;
+    for (int i = 0; i < cb->consumers; i++) {
+        cb->count[i] += span;
+        // Signal that slots are now full
+        pthread_cond_signal(cb->not_empty[i]);
+    }
+
+    return span;
+}
+
+/**
+ * Add `n` items from `items` to `cb`. Each round publishes as
+ * many items as every consumer has made room for, so the call
+ * only waits again if the span does not fit in the free space.
+ */
+int cb_put_n(CircularBuffer *cb, const char *items, int n) {
+    int done = 0;
+
     // Acquire mutex to modify buffer
     pthread_mutex_lock(cb->mutex);
-    
-    // Add item to buffer
-    cb->buffer[cb->tail] = item;
-    cb->tail = (cb->tail + 1) % cb->size;
-    // cb->count++;
-    
+    while (done < n) {
+        done += cb_put_span(cb, items ? items + done : NULL, n - done);
+    }
     // Release mutex
     pthread_mutex_unlock(cb->mutex);
-    
-    // Signal that a slot is now full
-    sem_post(cb->full[0]);
-    sem_post(cb->full[1]);
-    
-    return 0;
+
+    return done;
 }
 
 /**
- * Remove and return an item from `cb`. `cid` represents
- * the calling consumer thread and can be either `0` or `1`.
- * This value is used as an index on the `head`, `full`, 
- * and `read` arrays so the two consumers are consistently
- * tracked independent of each other.
+ * Remove up to `max` items from `cb` into `items`. `cid` represents
+ * the calling consumer thread and can be `0` to `consumers - 1`.
+ * This value is used as an index on the `head`, `count`, and
+ * `not_empty` arrays so the consumers are consistently tracked
+ * independent of each other.
+ * Waits until at least one item is available and returns the
+ * number of items copied, or 0 once the buffer is closed and empty.
  */
-char cb_get(CircularBuffer *cb, int cid) {
-    // Wait for a filled slot
-    sem_wait(cb->full[cid]);
-    
+int cb_get_n(CircularBuffer *cb, int cid, char *items, int max) {
     // Acquire mutex to modify buffer
     pthread_mutex_lock(cb->mutex);
-    
-    // Remove item from buffer
-    char item = cb->buffer[cb->head[cid]];
-    cb->head[cid] = (cb->head[cid] + 1) % cb->size;
-    // cb->count--;
-    
+
+    // Wait for a filled slot
+    while (cb->count[cid] == 0 && !cb->closed) {
+        cb_wait(cb, &cb->get_wait[cid], cb->not_empty[cid]);
+    }
+    ws_done(&cb->get_wait[cid]);
+
+    int span = cb->count[cid];
+    if (span > max) {
+        span = max;
+    }
+
+    // Copy the span, splitting it where it wraps around
+    int first = cb->size - cb->head[cid];
+    if (first > span) {
+        first = span;
+    }
+    if (items != NULL) {
+        memcpy(items, cb->buffer + cb->head[cid], first);
+        memcpy(items + first, cb->buffer, span - first);
+    }
+    cb->head[cid] = (cb->head[cid] + span) % cb->size;
+    cb->count[cid] -= span;
+
+    // Signal that empty slots may now be available; only the slowest
+    // consumer frees any, but which one that is changes as they read
+    if (span > 0) {
+        pthread_cond_signal(cb->not_full);
+    }
+
     // Release mutex
     pthread_mutex_unlock(cb->mutex);
-    
-    // Signal that an empty slot is now available
-    sem_post(cb->read[cid]);
-    
-    return item;
+
+    return span;
 }
 
-// Check if buffer is empty (not thread-safe, use carefully)
-// int cb_is_empty(CircularBuffer *cb) {
-//     return cb->count == 0;
-// }
+/**
+ * Number of items waiting for consumer `cid`, read without the
+ * mutex, so it may already be out of date (for statistics only).
+ */
+int cb_count(CircularBuffer *cb, int cid) {
+    return __atomic_load_n(&cb->count[cid], __ATOMIC_RELAXED);
+}
 
 /**
- * Cleanup function to close the semaphores, destroy the 
+ * Number of items the slowest consumer has not read yet, read
+ * without the mutex, so it may already be out of date (for
+ * statistics only).
+ */
+int cb_fill(CircularBuffer *cb) {
+    int used = 0;
+    for (int i = 0; i < cb->consumers; i++) {
+        int n = __atomic_load_n(&cb->count[i], __ATOMIC_RELAXED);
+        if (n > used) {
+            used = n;
+        }
+    }
+    return used;
+}
+
+/**
+ * Mark `cb` as closed after the producer's last item. Consumers
+ * drain whatever is left and then get a span of length 0.
+ */
+void cb_close(CircularBuffer *cb) {
+    pthread_mutex_lock(cb->mutex);
+    cb->closed = 1;
+    for (int i = 0; i < cb->consumers; i++) {
+        pthread_cond_broadcast(cb->not_empty[i]);
+    }
+    pthread_mutex_unlock(cb->mutex);
+}
+
+/**
+ * Cleanup function to destroy the condition variables and
  * mutex, and free allocated memory for `cb`.
  */
 void cb_destroy(CircularBuffer *cb) {
     // Destroy synchronization primitives
-    sem_close(cb->read[0]);
-    sem_close(cb->read[1]);
-    sem_close(cb->full[0]);
-    sem_close(cb->full[1]);
+    pthread_cond_destroy(cb->not_full);
+    for (int i = 0; i < cb->consumers; i++) {
+        pthread_cond_destroy(cb->not_empty[i]);
+        free(cb->not_empty[i]);
+    }
     pthread_mutex_destroy(cb->mutex);
-    
+
+    free(cb->not_full);
     free(cb->mutex);
     free(cb->buffer);
 }
+
+#endif // CB_LOCKFREE
+
+/**
+ * Add a single item to `cb`.
+ */
+int cb_put(CircularBuffer *cb, char item) {
+    cb_put_n(cb, &item, 1);
+    return 0;
+}
+
+/**
+ * Remove and return a single item from `cb` for consumer `cid`,
+ * or `EOF` once the buffer is closed and empty.
+ */
+char cb_get(CircularBuffer *cb, int cid) {
+    char item;
+    if (cb_get_n(cb, cid, &item, 1) == 0) {
+        return EOF;
+    }
+    return item;
+}
@@ -0,0 +1,122 @@
+/**********************************************************
+ * Microbenchmark for the encryption kernels. Encrypts a  *
+ * buffer of printable text repeatedly with each kernel   *
+ * (the per-character `encrypt`, the scalar block loop    *
+ * and, on x86, the SSE2 and AVX2 kernels), checks that   *
+ * they agree with `encrypt` and with each other at every *
+ * key timed, and prints the speed of each in bytes per   *
+ * cycle and MB/s.                                        *
+ * Usage: `encrypt-bench [bytes] [rounds]`                *
+ **********************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "encrypt-module.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * The module calls back into the driver on a reset, which never
+ * happens here since the benchmark does not start the module.
+ */
+void reset_requested() {}
+void reset_finished() {}
+
+typedef void (*Kernel)(const char *in, char *out, size_t n, int key);
+
+/**
+ * The original path: one call to `encrypt` per character, as the
+ * encryptor thread did before `encrypt_block`.
+ */
+void encrypt_block_per_char(const char *in, char *out, size_t n, int key) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = encrypt(in[i]);
+  }
+}
+
+unsigned long long cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Keys checked besides the timed ones: the SIMD kernels reduce keys
+ * from 160 up, so the keys around that edge and a large one.
+ */
+int edge_keys[] = { 159, 160, 161, 1000003 };
+
+/**
+ * Time `rounds` passes of `kernel` over `n` bytes, cycling the key
+ * the way the module does after each reset, and print the result.
+ * Returns 1 if the kernel's output differs from `encrypt` at the
+ * module's key, or from the scalar loop at any timed or edge key.
+ */
+int bench(const char *name, Kernel kernel, const char *in, char *out, size_t n, int rounds) {
+  char *expect = malloc(n);
+  encrypt_block_per_char(in, expect, n, get_key());
+  kernel(in, out, n, get_key());
+  int bad = memcmp(out, expect, n) != 0;
+  int edges = sizeof(edge_keys) / sizeof(edge_keys[0]);
+  // `encrypt` always uses the module's key, so per-char is only
+  // checked at that one
+  for (int r = 0; kernel != encrypt_block_per_char && r < rounds + edges && !bad; r++) {
+    int key = r < rounds ? 1 + 5 * r : edge_keys[r - rounds];
+    encrypt_block_scalar(in, expect, n, key);
+    kernel(in, out, n, key);
+    bad = memcmp(out, expect, n) != 0;
+  }
+  free(expect);
+
+  double t0 = seconds();
+  unsigned long long c0 = cycles();
+  for (int r = 0; r < rounds; r++) {
+    kernel(in, out, n, 1 + 5 * r);
+  }
+  unsigned long long c1 = cycles();
+  double t1 = seconds();
+
+  double bytes = (double) n * rounds;
+  printf("%-10s %8.3f bytes/cycle %10.1f MB/s%s\n", name,
+         c1 > c0 ? bytes / (c1 - c0) : 0.0, bytes / (t1 - t0) / 1e6,
+         bad ? "  MISMATCH" : "");
+  return bad;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 20;
+  int rounds = argc > 2 ? atoi(argv[2]) : 200;
+
+  char *in = malloc(n);
+  char *out = malloc(n);
+  srand(1);
+  for (size_t i = 0; i < n; i++) {
+    in[i] = 32 + rand() % 95;
+  }
+
+  printf("%zu bytes x %d rounds\n", n, rounds);
+  int bad = 0;
+  bad |= bench("per-char", encrypt_block_per_char, in, out, n, rounds);
+  bad |= bench("scalar", encrypt_block_scalar, in, out, n, rounds);
+#if defined(__x86_64__) || defined(__i386__)
+  bad |= bench("sse2", encrypt_block_sse2, in, out, n, rounds);
+  if (__builtin_cpu_supports("avx2")) {
+    bad |= bench("avx2", encrypt_block_avx2, in, out, n, rounds);
+  }
+#endif
+  bad |= bench("dispatch", encrypt_block, in, out, n, rounds);
+
+  free(in);
+  free(out);
+  return bad;
+}
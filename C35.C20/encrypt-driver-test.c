@@ -18,11 +18,11 @@ int init_buffers() {
   scanf("%d", &input_size);
   printf("Enter output buffer size: ");
   scanf("%d", &output_size);
-  if (cb_init(input_buffer, input_size) != 0) {
+  if (cb_init(input_buffer, input_size, 2) != 0) {
     printf("Fatal: Failed to initialize input buffer\n");
     return 1;
   }
-  if (cb_init(output_buffer, output_size) != 0) {
+  if (cb_init(output_buffer, output_size, 2) != 0) {
     printf("Fatal: Failed to initialize output buffer\n");
     return 1;
   }
@@ -118,25 +118,7 @@ void reset_requested() {
   pthread_mutex_lock(rc->reset_mutex);
   printf("Reset Requested.\n");
 
-  int inputs = get_input_total_count();
-  int outputs = get_output_total_count();
-
-  printf("| Inputs: %d / Outputs: %d\n", inputs, outputs);
-  if (inputs < outputs) {
-    sem_post(rc->sem_thread_lock[1]);
-    sem_post(rc->sem_thread_lock[2]);
-  }
-  if (inputs > outputs) {
-    sem_post(rc->sem_thread_lock[2]);
-    sem_post(rc->sem_thread_lock[3]);
-    sem_post(rc->sem_thread_lock[4]);
-  }
-  rc->reset_in_progress = 1;
-
-  if (inputs != outputs) {
-    printf("Waiting for input and output to synchronize...\n");
-    pthread_cond_wait(rc->reset_ready, rc->reset_mutex);
-  }
+  rc_drain(rc);
   printf("Counts are synced. Logging counts.\n");
 
   printf("Performing reset.\n");
@@ -168,7 +150,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  rc = malloc(sizeof(ResetController));
+  rc = aligned_alloc(_Alignof(ResetController), sizeof(ResetController));
   rc_init(rc);
 
   pthread_t read_thread, input_count_thread, encrypt_thread, output_count_thread, write_thread;
@@ -9,9 +9,44 @@
  * `encrypt-module.c`.
  **********************************************************/
 #include <fcntl.h>
+#include <getopt.h>
+#define encrypt encrypt_unistd
+#include <unistd.h>
+#undef encrypt
 #include "encrypt-module.h"
 #include "circular-buffer.h"
 #include "reset-controller.h"
+#include "stage-stats.h"
+#include "trace.h"
+#include "latency.h"
+#include "work-pool.h"
+#include "encrypt-service.h"
+
+/**
+ * Largest number of characters a thread moves through a buffer
+ * in one call. While a reset is in progress the counters and the
+ * encryptor process what they hold one character at a time.
+ */
+#define STAGE_SPAN 4096
+
+/**
+ * Characters a range worker reads, encrypts and writes at a time,
+ * a whole number of epochs.
+ */
+#define RANGE_CHUNK (320 * EPOCH_CHARS)
+
+/**
+ * In batch mode files of up to BATCH_INLINE characters are encrypted
+ * by a single task, and larger ones split into tasks of BATCH_SPLIT
+ * characters, a whole number of chunks.
+ */
+#define BATCH_INLINE (1 << 20)
+#define BATCH_SPLIT (64LL * RANGE_CHUNK)
+
+/**
+ * Size of both buffers in filter mode when `-b` is not given.
+ */
+#define FILTER_BUFFER_SIZE 65536
 
 /**
  * Declare global variables for the buffers and reset controller
@@ -22,26 +57,150 @@ CircularBuffer *output_buffer;
 ResetController *rc;
 
 /**
- * Initialize the buffers, prompting the user for their sizes.
+ * In mapped mode (`-m`) these point at the memory-mapped input and
+ * output files. Only positions then move through the buffers: each
+ * thread tracks its own offset and reads or writes the mappings
+ * there directly. Both are NULL in the default streaming mode.
  */
-int init_buffers() {
-  int input_size, output_size;
+char *input_map;
+char *output_map;
+
+/**
+ * Set by `-e`: resets no longer drain the pipeline. Each stage
+ * works out the epoch of a character from its offset in the
+ * stream, never lets a span cross into the next epoch, and uses
+ * that epoch's key and histograms (see `encrypt-module.h`).
+ */
+int epoch_mode;
+
+/**
+ * Set by `-j`: the number of encryptor workers. With more than one,
+ * each worker claims the next span of the input buffer under
+ * `claim_mutex`, noting its offset, encrypts it with its epochs'
+ * keys and waits until `committed` reaches that offset before
+ * putting it in the output buffer, so the output keeps its order.
+ * The last worker to finish closes the output buffer.
+ */
+int encryptors = 1;
+long long claimed;
+long long committed;
+atomic_int encryptors_left;
+pthread_mutex_t claim_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Set by `-c`: a checksum thread reads the output buffer as its
+ * third consumer and computes the CRC32C of the ciphertext for the
+ * log (see `checksum_enable`). `output_crc` is the CRC32C of the
+ * whole output once it has finished.
+ */
+int checksums;
+unsigned output_crc;
+
+/**
+ * Buffer sizes set by `-b`, or 0 to prompt for them.
+ */
+int input_size;
+int output_size;
+
+/**
+ * Cap a span of `max` characters starting at stream offset `at`
+ * so that in epoch mode it ends at or before the next epoch.
+ */
+int epoch_span(long long at, int max) {
+  if (!epoch_mode) {
+    return max;
+  }
+  int room = EPOCH_CHARS - at % EPOCH_CHARS;
+  return max < room ? max : room;
+}
+
+/**
+ * Take the next span for consumer `cid` of `cb` and return a
+ * pointer to it, storing its length in `n`. In mapped mode the span
+ * points into `map` at the consumer's offset `pos`; otherwise it is
+ * copied into `local`. The time taken is added to `st`.
+ */
+char *take_span(StageStats *st, CircularBuffer *cb, int cid, char *local, char *map, long long *pos, int *n) {
+  unsigned long long start = stats_now();
+  trace_begin("get");
+  *n = cb_get_n(cb, cid, map ? NULL : local, STAGE_SPAN);
+  trace_end("get");
+  st->buffer_ns += stats_now() - start;
+  char *span = map ? map + *pos : local;
+  *pos += *n;
+  return span;
+}
 
-  input_buffer = malloc(sizeof(CircularBuffer));
-  output_buffer = malloc(sizeof(CircularBuffer));
+/**
+ * Put `n` items into `cb` (only the positions if `items` is NULL),
+ * adding the time taken and the buffer's occupancy to `st`.
+ */
+void put_span(StageStats *st, CircularBuffer *cb, const char *items, int n) {
+  unsigned long long start = stats_now();
+  trace_begin("put");
+  cb_put_n(cb, items, n);
+  trace_end("put");
+  st->buffer_ns += stats_now() - start;
+  stats_occupancy(st, cb_fill(cb), cb->size);
+}
 
-  printf("Enter input buffer size: ");
-  scanf("%d", &input_size);
-  printf("Enter output buffer size: ");
-  scanf("%d", &output_size);
-  if (cb_init(input_buffer, input_size) != 0) {
+/**
+ * `thread_block` for `thread`, adding the time it takes to `st`
+ * when a reset may be in progress.
+ */
+int stage_block(StageStats *st, int thread) {
+  if (!rc_pending(rc)) {
+    return 0;
+  }
+  unsigned long long start = stats_now();
+  trace_begin("reset wait");
+  int blocked = thread_block(rc, thread);
+  trace_end("reset wait");
+  st->reset_ns += stats_now() - start;
+  return blocked;
+}
+
+/**
+ * Claim the statistics of a new thread called `name` (see
+ * `stats_register`) and give it its own ring in the trace.
+ */
+StageStats *stage_register(const char *name, int index) {
+  trace_thread(name, index);
+  return stats_register(name, index);
+}
+
+/**
+ * Initialize the buffers, prompting the user for their sizes
+ * unless they were given with `-b`.
+ */
+int init_buffers() {
+  // Aligned so the lock-free variant keeps its indexes on separate cache lines
+  input_buffer = aligned_alloc(_Alignof(CircularBuffer), sizeof(CircularBuffer));
+  output_buffer = aligned_alloc(_Alignof(CircularBuffer), sizeof(CircularBuffer));
+
+  if (input_size == 0) {
+    printf("Enter input buffer size: ");
+    scanf("%d", &input_size);
+    printf("Enter output buffer size: ");
+    scanf("%d", &output_size);
+  }
+  if (cb_init(input_buffer, input_size, 2) != 0) {
     printf("Fatal: Failed to initialize input buffer\n");
     return 1;
   }
-  if (cb_init(output_buffer, output_size) != 0) {
+  if (cb_init(output_buffer, output_size, checksums ? 3 : 2) != 0) {
     printf("Fatal: Failed to initialize output buffer\n");
     return 1;
   }
+  // The two counters can be at most both buffers and the spans held by
+  // the encryptors and one counter apart, which bounds the epochs in flight
+  int in_flight = input_size + output_size + (encryptors + 1) * STAGE_SPAN;
+  if (epoch_mode && epoch_init(in_flight / EPOCH_CHARS + 3) != 0) {
+    printf("Fatal: Failed to initialize epoch counts\n");
+    return 1;
+  }
 
   return 0;
 }
@@ -58,57 +217,173 @@ void destroy_buffers() {
 
 /**
  * Function to be run by the reader thread.
+ * Reads a block of characters and publishes it to the input
+ * buffer in one round, closing the buffer at end of file.
+ * In mapped mode it only claims the next block of the mapping.
  */
 void *reader() {
-  char c;
+  StageStats *st = stage_register("reader", 0);
+  char span[STAGE_SPAN];
+  long long pos = 0;
   while (1) {
-    if (thread_block(rc, 0)) {
+    if (stage_block(st, 0)) {
       continue;
     }
 
-    c = read_input();
-    cb_put(input_buffer, c);
-    if (c == EOF) {
+    int n;
+    trace_begin("read");
+    if (input_map) {
+      n = read_input_mapped(STAGE_SPAN);
+    } else {
+      n = read_input_block(span, STAGE_SPAN);
+    }
+    trace_end("read");
+    if (n == 0) {
+      cb_close(input_buffer);
       return 0;
     }
+    if (latency_enabled) {
+      latency_read(pos, n);
+    }
+    pos += n;
+    put_span(st, input_buffer, input_map ? NULL : span, n);
+    st->chars += n;
+    st->spans++;
   }
 }
 
 /**
  * Function to be run by the input counter thread.
+ * Takes a span from the input buffer and counts as much of
+ * it as the reset controller allows on each pass. In epoch
+ * mode it also reports each epoch it finishes counting.
  */
 void *input_counter() {
-  char c;
+  StageStats *st = stage_register("input_counter", 0);
+  char local[STAGE_SPAN];
+  char *span = local;
+  long long pos = 0;
+  int n = 0, done = 0;
   while (1) {
-    if (thread_block(rc, 1)) {
+    if (stage_block(st, 1)) {
       continue;
     }
 
-    c = cb_get(input_buffer, 0);
-    if (c == EOF) {
-      return 0;
+    if (done == n) {
+      span = take_span(st, input_buffer, 0, local, input_map, &pos, &n);
+      st->spans++;
+      done = 0;
+      if (n == 0) {
+        return 0;
+      }
+    }
+    long long at = pos - n + done;
+    int k = epoch_span(at, rc_span_begin(rc, 1, n - done));
+    trace_begin("count");
+    if (epoch_mode) {
+      count_input_epoch(at / EPOCH_CHARS, span + done, k);
+    } else {
+      count_input_block(span + done, k);
+    }
+    trace_end("count");
+    rc_span_end(rc, 1);
+    st->chars += k;
+    done += k;
+    if (epoch_mode && (at + k) % EPOCH_CHARS == 0) {
+      trace_begin("log");
+      epoch_finished(at / EPOCH_CHARS);
+      trace_end("log");
     }
-    count_input(c);
   }
 }
 
 /**
  * Function to be run by the encryptor thread.
+ * Encrypts as much of each span as the reset controller allows
+ * with `encrypt_block`, reading the key once per call (or using
+ * the key of the span's epoch in epoch mode).
+ * In mapped mode the ciphertext goes straight into the output
+ * mapping at the same offset as the plaintext.
  */
 void *encryptor() {
-  char c, e;
+  StageStats *st = stage_register("encryptor", 0);
+  char local[STAGE_SPAN], e_local[STAGE_SPAN];
+  char *span = local, *e = e_local;
+  long long pos = 0;
+  int n = 0, done = 0;
   while (1) {
-    if (thread_block(rc, 2)) {
+    if (stage_block(st, 2)) {
       continue;
     }
 
-    c = cb_get(input_buffer, 1);
-    if (c == EOF) {
-      cb_put(output_buffer, c);
+    if (done == n) {
+      span = take_span(st, input_buffer, 1, local, input_map, &pos, &n);
+      st->spans++;
+      e = output_map ? output_map + (pos - n) : e_local;
+      done = 0;
+      if (n == 0) {
+        cb_close(output_buffer);
+        return 0;
+      }
+    }
+    long long at = pos - n + done;
+    int k = epoch_span(at, rc_span_begin(rc, 2, n - done));
+    trace_begin("encrypt");
+    encrypt_block(span + done, e + done, k, epoch_mode ? epoch_key(at / EPOCH_CHARS) : get_key());
+    trace_end("encrypt");
+    rc_span_end(rc, 2);
+    put_span(st, output_buffer, output_map ? NULL : e + done, k);
+    st->chars += k;
+    done += k;
+  }
+}
+
+/**
+ * Function to be run by each of the encryptor workers when there
+ * is more than one. Only used in epoch mode, where the key of a
+ * span follows from its offset and there are no resets to drain.
+ */
+void *encrypt_worker(void *arg) {
+  StageStats *st = stage_register("encryptor", *(int *) arg);
+  char local[STAGE_SPAN], e_local[STAGE_SPAN];
+  int n;
+  while (1) {
+    pthread_mutex_lock(&claim_mutex);
+    char *span = take_span(st, input_buffer, 1, local, input_map, &claimed, &n);
+    long long at = claimed - n;
+    pthread_mutex_unlock(&claim_mutex);
+    if (n == 0) {
+      if (atomic_fetch_sub(&encryptors_left, 1) == 1) {
+        cb_close(output_buffer);
+      }
       return 0;
     }
-    e = encrypt(c);
-    cb_put(output_buffer, e);
+
+    char *e = output_map ? output_map + at : e_local;
+    trace_begin("encrypt");
+    for (int done = 0; done < n;) {
+      int k = epoch_span(at + done, n - done);
+      encrypt_block(span + done, e + done, k, epoch_key((at + done) / EPOCH_CHARS));
+      done += k;
+    }
+    trace_end("encrypt");
+
+    trace_begin("commit wait");
+    pthread_mutex_lock(&commit_mutex);
+    while (committed != at) {
+      pthread_cond_wait(&commit_cond, &commit_mutex);
+    }
+    pthread_mutex_unlock(&commit_mutex);
+    trace_end("commit wait");
+
+    put_span(st, output_buffer, output_map ? NULL : e, n);
+    st->chars += n;
+    st->spans++;
+
+    pthread_mutex_lock(&commit_mutex);
+    committed += n;
+    pthread_cond_broadcast(&commit_cond);
+    pthread_mutex_unlock(&commit_mutex);
   }
 }
 
@@ -116,78 +391,480 @@ void *encryptor() {
  * Function to be run by the output counter thread.
  */
 void *output_counter() {
-  char c;
+  StageStats *st = stage_register("output_counter", 0);
+  char local[STAGE_SPAN];
+  char *span = local;
+  long long pos = 0;
+  int n = 0, done = 0;
   while (1) {
-    if (thread_block(rc, 3)) {
+    if (stage_block(st, 3)) {
       continue;
     }
 
-    c = cb_get(output_buffer, 0);
-    if (c == EOF) {
-      return 0;
+    if (done == n) {
+      span = take_span(st, output_buffer, 0, local, output_map, &pos, &n);
+      st->spans++;
+      done = 0;
+      if (n == 0) {
+        return 0;
+      }
+    }
+    long long at = pos - n + done;
+    int k = epoch_span(at, rc_span_begin(rc, 3, n - done));
+    trace_begin("count");
+    if (epoch_mode) {
+      count_output_epoch(at / EPOCH_CHARS, span + done, k);
+    } else {
+      count_output_block(span + done, k);
+    }
+    trace_end("count");
+    rc_span_end(rc, 3);
+    st->chars += k;
+    done += k;
+    if (epoch_mode && (at + k) % EPOCH_CHARS == 0) {
+      trace_begin("log");
+      epoch_finished(at / EPOCH_CHARS);
+      trace_end("log");
     }
-    count_output(c);
   }
 }
 
 /**
  * Function to be run by the writer thread.
+ * In mapped mode the ciphertext is already in place, so it only
+ * marks the span as final.
  */
 void *writer() {
-  char c;
+  StageStats *st = stage_register("writer", 0);
+  char local[STAGE_SPAN];
+  long long pos = 0;
+  int n;
   while (1) {
-    if (thread_block(rc, 4)) {
+    if (stage_block(st, 4)) {
       continue;
     }
 
-    c = cb_get(output_buffer, 1);
-    if (c == EOF) {
+    char *span = take_span(st, output_buffer, 1, local, output_map, &pos, &n);
+    if (n == 0) {
+      return 0;
+    }
+    trace_begin("write");
+    if (output_map) {
+      write_output_mapped(n);
+    } else {
+      write_output_block(span, n);
+    }
+    trace_end("write");
+    if (latency_enabled) {
+      latency_written(pos);
+    }
+    st->chars += n;
+    st->spans++;
+  }
+}
+
+/**
+ * Function to be run by the checksum thread. It only reads the
+ * output buffer, so it takes no part in resets, and the writer is
+ * never held up by it unless it falls a whole buffer behind.
+ */
+void *checksummer() {
+  StageStats *st = stage_register("checksum", 0);
+  char local[STAGE_SPAN];
+  long long pos = 0;
+  int n;
+  while (1) {
+    char *span = take_span(st, output_buffer, 2, local, output_map, &pos, &n);
+    if (n == 0) {
+      output_crc = checksum_finish();
       return 0;
     }
-    write_output(c);
+    trace_begin("checksum");
+    checksum_output(span, n);
+    trace_end("checksum");
+    st->chars += n;
+    st->spans++;
   }
 }
 
+/**
+ * One part of an input file in range or batch mode: the characters
+ * from `start` up to `end`, with `start` at an epoch boundary. The
+ * last range also logs the final (partial or empty) epoch. `file`
+ * is the batch file the range belongs to, or NULL for the module's
+ * files; `failed` is set if the range could not be read, written or
+ * logged.
+ */
+typedef struct {
+  long long start;
+  long long end;
+  int last;
+  int index;
+  RangeLog *log;
+  BatchFile *file;
+  int failed;
+} Range;
+
+/**
+ * Encrypt the range `r` an epoch at a time with that epoch's key,
+ * a chunk at a time through `in` and `out` (of RANGE_CHUNK
+ * characters each), writing the ciphertext at the same offset and
+ * logging each epoch to `r->log`.
+ */
+void encrypt_range(Range *r, StageStats *st, char *in, char *out) {
+  long long at = r->start;
+  while (at < r->end) {
+    int want = r->end - at < RANGE_CHUNK ? r->end - at : RANGE_CHUNK;
+    trace_begin("read");
+    int n = r->file ? batch_read_range(r->file, in, at, want) : read_input_range(in, at, want);
+    trace_end("read");
+    if (n <= 0) {
+      // An error, or the input shrank since its size was taken
+      r->failed = 1;
+      break;
+    }
+    trace_begin("encrypt");
+    for (int done = 0; done < n;) {
+      long long epoch = (at + done) / EPOCH_CHARS;
+      int k = n - done < EPOCH_CHARS ? n - done : EPOCH_CHARS;
+      encrypt_block(in + done, out + done, k, epoch_key(epoch));
+      range_log_count(r->log, in + done, out + done, k);
+      done += k;
+      if ((at + done) % EPOCH_CHARS == 0) {
+        range_log_epoch(r->log, epoch);
+      }
+    }
+    trace_end("encrypt");
+    trace_begin("write");
+    if (r->file) {
+      r->failed |= batch_write_range(r->file, out, at, n) != 0;
+    } else {
+      r->failed |= write_output_range(out, at, n) != 0;
+    }
+    trace_end("write");
+    st->chars += n;
+    st->spans++;
+    at += n;
+  }
+  if (r->last) {
+    range_log_epoch(r->log, at / EPOCH_CHARS);
+  }
+}
+
+/**
+ * Function to be run by each range worker, encrypting one range of
+ * the module's files into a log of its own.
+ */
+void *range_worker(void *arg) {
+  Range *r = arg;
+  StageStats *st = stage_register("range", r->index);
+  char *in = malloc(RANGE_CHUNK);
+  char *out = malloc(RANGE_CHUNK);
+  r->log = range_log_open();
+  if (in == NULL || out == NULL || r->log == NULL) {
+    r->failed = 1;
+  } else {
+    encrypt_range(r, st, in, out);
+  }
+  free(in);
+  free(out);
+  return 0;
+}
+
+/**
+ * Encrypt a regular input file of `size` characters by splitting
+ * it into `parts` ranges at epoch boundaries and running a worker
+ * on each. Since the key of every epoch is known up front, the
+ * ranges do not depend on each other; their logs are appended in
+ * order once all of them are done. Returns 0, or -1 if any range
+ * failed.
+ */
+int run_ranges(long long size, int parts) {
+  long long epochs = size / EPOCH_CHARS;
+  if (parts > epochs) {
+    parts = epochs > 0 ? epochs : 1;
+  }
+  Range *ranges = malloc(parts * sizeof(Range));
+  pthread_t *threads = malloc(parts * sizeof(pthread_t));
+  for (int p = 0; p < parts; p++) {
+    ranges[p].start = epochs * p / parts * EPOCH_CHARS;
+    ranges[p].end = p == parts - 1 ? size : epochs * (p + 1) / parts * EPOCH_CHARS;
+    ranges[p].last = p == parts - 1;
+    ranges[p].index = p + 1;
+    ranges[p].file = NULL;
+    ranges[p].failed = 0;
+    pthread_create(&threads[p], NULL, &range_worker, &ranges[p]);
+  }
+  int failed = 0;
+  for (int p = 0; p < parts; p++) {
+    pthread_join(threads[p], NULL);
+    failed |= ranges[p].failed;
+    if (ranges[p].log != NULL) {
+      trace_begin("log");
+      range_log_close(ranges[p].log);
+      trace_end("log");
+    }
+  }
+  free(ranges);
+  free(threads);
+  return failed ? -1 : 0;
+}
+
+/**
+ * A file in batch mode, split into `parts` ranges. `left` counts
+ * the ranges not yet encrypted; the task finishing the last one
+ * appends their logs in order and closes the file.
+ */
+typedef struct {
+  BatchFile *file;
+  char *name;
+  int parts;
+  atomic_int left;
+  Range *ranges;
+} BatchJob;
+
+/**
+ * A task opening one line of the manifest, and a task encrypting
+ * one range of an opened file.
+ */
+typedef struct {
+  PoolTask task;
+  char *input;
+  char *output;
+  char *log;
+} FileTask;
+
+typedef struct {
+  PoolTask task;
+  BatchJob *job;
+  int part;
+} RangeTask;
+
+atomic_int batch_done;
+atomic_int batch_failed;
+_Thread_local StageStats *batch_stats;
+
+/**
+ * The input and output chunks of every batch worker, RANGE_CHUNK
+ * characters each, allocated once by `run_batch`.
+ */
+char *batch_buffers;
+_Thread_local char *batch_in;
+_Thread_local char *batch_out;
+
+void batch_start(int worker) {
+  batch_stats = stage_register("batch", worker + 1);
+  batch_in = batch_buffers + (size_t) worker * 2 * RANGE_CHUNK;
+  batch_out = batch_in + RANGE_CHUNK;
+}
+
+void service_start(int worker) {
+  stage_register("service", worker + 1);
+}
+
+/**
+ * Encrypt range `part` of `job` and, if it was the last one left,
+ * finish the file.
+ */
+void batch_run_range(BatchJob *job, int part) {
+  Range *r = &job->ranges[part];
+  if (r->log != NULL) {
+    encrypt_range(r, batch_stats, batch_in, batch_out);
+  }
+  if (atomic_fetch_sub(&job->left, 1) != 1) {
+    return;
+  }
+  int failed = 0;
+  trace_begin("log");
+  for (int p = 0; p < job->parts; p++) {
+    if (job->ranges[p].log != NULL) {
+      batch_log(job->file, job->ranges[p].log);
+    }
+    failed |= job->ranges[p].failed;
+  }
+  trace_end("log");
+  failed |= batch_close(job->file) != 0;
+  if (failed) {
+    printf("Failed to read, write or log `%s`.\n", job->name);
+    atomic_fetch_add(&batch_failed, 1);
+  } else {
+    atomic_fetch_add(&batch_done, 1);
+  }
+  free(job->name);
+  free(job->ranges);
+  free(job);
+}
+
+void run_range_task(PoolTask *task, WorkPool *pool, int worker) {
+  RangeTask *rt = (RangeTask *) task;
+  batch_run_range(rt->job, rt->part);
+  free(rt);
+}
+
+/**
+ * Open the files of one manifest line. A small file is encrypted
+ * right away as a single range; a larger one is split into ranges
+ * at BATCH_SPLIT boundaries, all but the first pushed onto this
+ * worker's deque for idle workers to steal.
+ */
+void run_file_task(PoolTask *task, WorkPool *pool, int worker) {
+  FileTask *ft = (FileTask *) task;
+  BatchFile *bf = batch_open(ft->input, ft->output, ft->log);
+  if (bf == NULL) {
+    printf("Failed to open `%s`, `%s` or `%s`, or the input is not a regular file.\n", ft->input,
+           ft->output, ft->log);
+    atomic_fetch_add(&batch_failed, 1);
+  }
+  free(ft->output);
+  free(ft->log);
+  if (bf == NULL) {
+    free(ft->input);
+    free(ft);
+    return;
+  }
+
+  long long size = batch_size(bf);
+  int parts = size <= BATCH_INLINE ? 1 : (size + BATCH_SPLIT - 1) / BATCH_SPLIT;
+  BatchJob *job = malloc(sizeof(BatchJob));
+  Range *ranges = malloc(parts * sizeof(Range));
+  if (job == NULL || ranges == NULL) {
+    printf("Out of memory encrypting `%s`.\n", ft->input);
+    atomic_fetch_add(&batch_failed, 1);
+    batch_close(bf);
+    free(job);
+    free(ranges);
+    free(ft->input);
+    free(ft);
+    return;
+  }
+  job->file = bf;
+  job->name = ft->input;
+  free(ft);
+  job->parts = parts;
+  job->ranges = ranges;
+  atomic_init(&job->left, job->parts);
+  for (int p = 0; p < job->parts; p++) {
+    Range *r = &job->ranges[p];
+    r->start = p * BATCH_SPLIT;
+    r->end = p == job->parts - 1 ? size : (p + 1) * BATCH_SPLIT;
+    r->last = p == job->parts - 1;
+    r->index = p + 1;
+    r->log = job->parts == 1 ? batch_log_open(bf) : range_log_open();
+    r->file = bf;
+    r->failed = r->log == NULL;
+  }
+  for (int p = job->parts - 1; p > 0; p--) {
+    RangeTask *rt = malloc(sizeof(RangeTask));
+    if (rt == NULL) {
+      batch_run_range(job, p);
+      continue;
+    }
+    rt->task.run = &run_range_task;
+    rt->job = job;
+    rt->part = p;
+    if (pool_push(pool, worker, &rt->task) != 0) {
+      free(rt);
+      batch_run_range(job, p);
+    }
+  }
+  batch_run_range(job, 0);
+}
+
+/**
+ * Encrypt every file listed in the manifest at `path`, one
+ * `input output log` triple per line (blank lines and lines starting
+ * with `#` are skipped), on a pool of `workers` threads. Each file
+ * gets the output and log a run of `encrypt` on it alone would give.
+ * Returns the number of files that failed, or -1 if the manifest
+ * cannot be read, the workers' buffers cannot be allocated or the
+ * batch was cut short for lack of memory.
+ */
+int run_batch(const char *path, int workers) {
+  FILE *manifest = fopen(path, "r");
+  if (manifest == NULL) {
+    printf("Failed to read the manifest `%s`.\n", path);
+    return -1;
+  }
+  batch_buffers = malloc((size_t) workers * 2 * RANGE_CHUNK);
+  if (batch_buffers == NULL) {
+    printf("Failed to allocate buffers for %d workers.\n", workers);
+    fclose(manifest);
+    return -1;
+  }
+  WorkPool pool;
+  pool_init(&pool, workers, &batch_start);
+  char line[3 * 4096];
+  int files = 0, aborted = 0;
+  while (fgets(line, sizeof(line), manifest) != NULL) {
+    char input[4096], output[4096], log[4096];
+    if (line[0] == '#' || sscanf(line, "%4095s %4095s %4095s", input, output, log) != 3) {
+      continue;
+    }
+    FileTask *ft = calloc(1, sizeof(FileTask));
+    if (ft == NULL || (ft->input = strdup(input)) == NULL ||
+        (ft->output = strdup(output)) == NULL || (ft->log = strdup(log)) == NULL) {
+      printf("Out of memory queueing `%s`.\n", input);
+      atomic_fetch_add(&batch_failed, 1);
+      if (ft != NULL) {
+        free(ft->input);
+        free(ft->output);
+      }
+      free(ft);
+      continue;
+    }
+    ft->task.run = &run_file_task;
+    if (pool_push(&pool, files++ % workers, &ft->task) != 0) {
+      printf("Out of memory queueing `%s`, skipping the rest of the manifest.\n", input);
+      free(ft->input);
+      free(ft->output);
+      free(ft->log);
+      free(ft);
+      aborted = 1;
+      break;
+    }
+  }
+  fclose(manifest);
+  pool_run(&pool);
+  free(batch_buffers);
+  printf("Encrypted %d files, %d failed.\n", atomic_load(&batch_done), atomic_load(&batch_failed));
+  return aborted ? -1 : atomic_load(&batch_failed);
+}
+
 /**
  * Called when the encrypt-module requests a reset, so the
  * input and output counts can be synchronized before the
  * reset is performed.
- * Acquires a lock on the global ResetController to block
- * all driver threads, then compares the total input and
- * output counts and resumes the side that is behind.
- * Waits for one of those threads to signal `reset_ready`
- * when the counts are equal before returning and allowing
- * the reset to complete.
+ * Acquires a lock on the global ResetController and drains
+ * the pipeline with `rc_drain`, which blocks all driver threads
+ * and lets the lagging ones catch up until both counts reach
+ * the number of characters read, then logs the counts before
+ * returning and allowing the reset to complete.
+ * In epoch mode there is nothing to synchronize, since every
+ * stage already knows which key and counts each character uses.
  */
 void reset_requested() {
+  if (epoch_mode) {
+    return;
+  }
+  trace_begin("reset_requested");
   pthread_mutex_lock(rc->reset_mutex);
   printf("Reset Requested.\n");
 
-  int inputs = get_input_total_count();
-  int outputs = get_output_total_count();
-
-  printf("| Inputs: %d / Outputs: %d\n", inputs, outputs);
-  if (inputs < outputs) {
-    sem_post(rc->sem_thread_lock[1]);
-    sem_post(rc->sem_thread_lock[2]);
-  }
-  if (inputs > outputs) {
-    sem_post(rc->sem_thread_lock[2]);
-    sem_post(rc->sem_thread_lock[3]);
-    sem_post(rc->sem_thread_lock[4]);
-  }
-  rc->reset_in_progress = 1;
-
-  if (inputs != outputs) {
-    printf("Waiting for input and output to synchronize...\n");
-    pthread_cond_wait(rc->reset_ready, rc->reset_mutex);
+  if (latency_enabled) {
+    latency_drain_begin();
   }
+  trace_begin("drain");
+  rc_drain(rc);
+  trace_end("drain");
   printf("Counts are synced. Logging counts.\n");
 
+  trace_begin("log");
 	log_counts();
+  trace_end("log");
 
   printf("Performing reset.\n");
   pthread_mutex_unlock(rc->reset_mutex);
+  trace_end("reset_requested");
 }
 
 /**
@@ -195,6 +872,10 @@ void reset_requested() {
  * driver threads can be resumed.
  */
 void reset_finished() {
+  if (epoch_mode) {
+    return;
+  }
+  trace_begin("reset_finished");
   pthread_mutex_lock(rc->reset_mutex);
   printf("Reset finished.\n");
 
@@ -202,48 +883,326 @@ void reset_finished() {
 
   printf("Resuming blocked threads.\n\n");
   pthread_cond_broadcast(rc->reset_cond);
+  if (latency_enabled) {
+    latency_drain_end();
+  }
 
   pthread_mutex_unlock(rc->reset_mutex);
+  trace_end("reset_finished");
+}
+
+/**
+ * Write the trace to `path` if tracing is on. Returns the exit
+ * status for `main`: 1 if the trace could not be written.
+ */
+int write_trace(const char *path) {
+  if (path == NULL) {
+    return 0;
+  }
+  if (trace_dump(path) != 0) {
+    printf("Failed to write the trace to `%s`.\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Print the ways `prog` can be run and its options.
+ */
+void usage(const char *prog) {
+  printf("Correct Usage: `%s [options] <input_file> <output_file> <log_file>` or `%s -F [options] "
+         "<log_file>` or `%s -B <manifest> [options]` or `%s -S <socket> [options]`.\n",
+         prog, prog, prog, prog);
+  printf("Options: [-w policy] [-m] [-e] [-j n] [-p n] [-s] [-P] [-t file] [-l] [-L format] [-u] "
+         "[-c] [-b in:out]\n");
 }
 
 /** Main function
- * Entry point of the program - reads the input file name,
- * output file name, and log file name from the arguments
- * and initializes the encrypt-module, then initializes the
- * input and output buffers and the reset controller.
+ * Entry point of the program - reads the options, the input
+ * file name, output file name, and log file name from the
+ * arguments and initializes the encrypt-module, then initializes
+ * the input and output buffers and the reset controller.
  * Finally creates the five driver threads and waits for them
  * to complete and logs the final input and output counts.
+ * Options:
+ *   -w <policy>  wait policy: adaptive (default), park, spin or yield
+ *   -m           map the input and output files instead of streaming
+ *                them, falling back to streaming for non-regular files
+ *   -e           keep streaming across resets, tagging characters with
+ *                the epoch they were read in instead of draining
+ *   -j <n>       run n encryptor workers (implies -e when n > 1)
+ *   -p <n>       split a regular input file into n ranges encrypted in
+ *                parallel, bypassing the five-thread pipeline
+ *   -s           print each thread's statistics on standard error at
+ *                exit (they are also printed on SIGUSR1)
+ *   -P           also count cycles, instructions, cache and branch misses
+ *                and context switches per thread with perf_event_open,
+ *                where available (implies -s)
+ *   -t <file>    record a timeline of every thread's work, waits, resets
+ *                and log writes, written to file at exit as Chrome trace
+ *                event JSON
+ *   -l           print on standard error at exit how long characters took
+ *                from being read to being written, apart for those in
+ *                flight while a reset drained the pipeline, and how long
+ *                those were held (not in range mode; in epoch mode, where
+ *                nothing waits for a reset, all are counted as steady)
+ *   -L <format>  log format: text (default), sparse or binary
+ *                (see `set_log_format` in `encrypt-module.h`)
+ *   -u           read and write regular files through io_uring, keeping
+ *                several large reads and writes in flight, or through
+ *                pread/pwrite where io_uring is not available
+ *   -b <in:out>  buffer sizes, instead of prompting for them
+ *   -B <file>    batch mode: encrypt every input, output and log file
+ *                triple listed in the manifest file on a work-stealing
+ *                pool of threads, one per CPU (or -j n), taking no other
+ *                file names
+ *   -S <socket>  service mode: serve encryption sessions on the Unix socket
+ *                until killed, on one thread per CPU (or -j n) besides
+ *                the epoll loop (see `encrypt-service.h`)
+ *   -F           filter mode: read standard input and write standard
+ *                output, taking only the log file name; the messages go
+ *                to standard error and the buffers default to 65536
  */
 int main(int argc, char *argv[]) {
+  int opt, mapped = 0, ranges = 0, show_stats = 0, filter = 0, async = 0, workers = 0;
+  const char *manifest = NULL, *service = NULL;
+  const char *trace_path = NULL;
+  while ((opt = getopt(argc, argv, "w:mej:p:sPt:lL:b:FuB:S:c")) != -1) {
+    switch (opt) {
+    case 'w':
+      if (wait_policy_select(optarg) != 0) {
+        printf("Unknown wait policy `%s`. Choose adaptive, park, spin or yield.\n", optarg);
+        return 1;
+      }
+      break;
+    case 'm':
+      mapped = 1;
+      break;
+    case 'e':
+      epoch_mode = 1;
+      break;
+    case 'p':
+      ranges = atoi(optarg);
+      if (ranges < 1) {
+        printf("The number of ranges must be at least 1.\n");
+        return 1;
+      }
+      break;
+    case 's':
+      show_stats = 1;
+      break;
+    case 'P':
+      stats_perf = 1;
+      show_stats = 1;
+      break;
+    case 'b':
+      if (sscanf(optarg, "%d:%d", &input_size, &output_size) != 2 || input_size < 1 || output_size < 1) {
+        printf("Buffer sizes must be given as <in>:<out>, both at least 1.\n");
+        return 1;
+      }
+      break;
+    case 'F':
+      filter = 1;
+      break;
+    case 'S':
+      service = optarg;
+      break;
+    case 'B':
+      manifest = optarg;
+      break;
+    case 'u':
+      async = 1;
+      break;
+    case 'L':
+      if (set_log_format(optarg) != 0) {
+        printf("Unknown log format `%s`. Choose text, sparse or binary.\n", optarg);
+        return 1;
+      }
+      break;
+    case 'l':
+      latency_enabled = 1;
+      break;
+    case 'c':
+      checksums = 1;
+      break;
+    case 't':
+      trace_path = optarg;
+      trace_enabled = 1;
+      break;
+    case 'j':
+      encryptors = workers = atoi(optarg);
+      if (encryptors < 1) {
+        printf("The number of encryptors must be at least 1.\n");
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
 
-  if (argc != 4) {
-    printf("Incorrect arguments.\nCorrect Usage: `encrypt <input_file> <output_file> <log_file>`\n");
+  if (service != NULL) {
+    if (argc != optind) {
+      printf("Service mode takes no file names.\n");
+      return 1;
+    }
+    stats_init();
+    if (run_service(service, workers > 0 ? workers : sysconf(_SC_NPROCESSORS_ONLN), &service_start) != 0) {
+      printf("Failed to listen on `%s`.\n", service);
+      return 1;
+    }
+    return 0;
+  }
+
+  if (manifest != NULL) {
+    if (argc != optind) {
+      printf("Batch mode takes its file names from the manifest only.\n");
+      return 1;
+    }
+    stats_init();
+    trace_thread("main", 0);
+    int failed = run_batch(manifest, workers > 0 ? workers : sysconf(_SC_NPROCESSORS_ONLN));
+    if (failed < 0) {
+      return 1;
+    }
+    if (show_stats) {
+      stats_print(stderr);
+    }
+    return write_trace(trace_path) != 0 || failed > 0;
+  }
+
+  if (encryptors > 1) {
+    epoch_mode = 1;
+  }
+
+  if (argc - optind != (filter ? 1 : 3)) {
+    printf("Incorrect arguments.\n");
+    usage(argv[0]);
     return 1;
   }
+  // Before init, so every thread inherits the blocked SIGUSR1
+  stats_init();
+  trace_thread("main", 0);
 	// init("in.txt", "out.txt", "log.txt"); 
-  init(argv[1], argv[2], argv[3]);
+  if (filter) {
+    // Keep standard output for the ciphertext and send the messages to
+    // standard error instead
+    int output_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    if (output_fd < 0 || init_streams(STDIN_FILENO, output_fd, argv[optind]) != 0) {
+      printf("Fatal: Failed to open the standard streams\n");
+      return 1;
+    }
+    if (input_size == 0) {
+      input_size = output_size = FILTER_BUFFER_SIZE;
+    }
+  } else {
+    init(argv[optind], argv[optind + 1], argv[optind + 2]);
+  }
+  if (ranges > 0) {
+    long long size = input_file_size();
+    if (size >= 0) {
+      if (checksums) {
+        printf("Checksums are only computed in the pipeline.\n");
+      }
+      int failed = run_ranges(size, ranges) != 0;
+      log_flush();
+      if (failed) {
+        printf("Failed to read, write or log the input in ranges.\n");
+      } else {
+        printf("End of file reached.\n");
+      }
+      if (show_stats) {
+        stats_print(stderr);
+      }
+      return write_trace(trace_path) | failed;
+    }
+    printf("Input or output is not a regular file, using the pipeline.\n");
+  }
+  if (mapped && map_files(&input_map, &output_map) < 0) {
+    printf("Input or output cannot be mapped, using the streaming path.\n");
+  }
+  if (async && input_map == NULL) {
+    int uring = open_async_io();
+    if (uring < 0) {
+      printf("Input or output is not a regular file, using stdio.\n");
+    } else if (!uring) {
+      printf("io_uring is not available, using pread and pwrite.\n");
+    }
+  }
 
   if (init_buffers()) {
     return 1;
   }
 
-  rc = malloc(sizeof(ResetController));
+  rc = aligned_alloc(_Alignof(ResetController), sizeof(ResetController));
   rc_init(rc);
+  if (checksums) {
+    checksum_enable();
+  }
 
-  pthread_t read_thread, input_count_thread, encrypt_thread, output_count_thread, write_thread;
+  pthread_t read_thread, input_count_thread, output_count_thread, write_thread, checksum_thread;
+  pthread_t *encrypt_threads = malloc(encryptors * sizeof(pthread_t));
+  int *encryptor_ids = malloc(encryptors * sizeof(int));
+  atomic_init(&encryptors_left, encryptors);
   pthread_create(&read_thread, NULL, &reader, NULL);
   pthread_create(&input_count_thread, NULL, &input_counter, NULL);
-  pthread_create(&encrypt_thread, NULL, &encryptor, NULL);
+  if (encryptors == 1) {
+    pthread_create(&encrypt_threads[0], NULL, &encryptor, NULL);
+  } else {
+    for (int t = 0; t < encryptors; t++) {
+      encryptor_ids[t] = t + 1;
+      pthread_create(&encrypt_threads[t], NULL, &encrypt_worker, &encryptor_ids[t]);
+    }
+  }
   pthread_create(&output_count_thread, NULL, &output_counter, NULL);
   pthread_create(&write_thread, NULL, &writer, NULL);
+  if (checksums) {
+    pthread_create(&checksum_thread, NULL, &checksummer, NULL);
+  }
 
   pthread_join(read_thread, NULL);
   pthread_join(input_count_thread, NULL);
-  pthread_join(encrypt_thread, NULL);
+  for (int t = 0; t < encryptors; t++) {
+    pthread_join(encrypt_threads[t], NULL);
+  }
+  free(encrypt_threads);
+  free(encryptor_ids);
   pthread_join(output_count_thread, NULL);
   pthread_join(write_thread, NULL);
+  if (checksums) {
+    pthread_join(checksum_thread, NULL);
+  }
 
 	printf("End of file reached.\n"); 
+  if (checksums) {
+    printf("Output CRC32C: %08x\n", output_crc);
+  }
   destroy_buffers();
-	log_counts();
+  int io_failed = close_async_io() != 0;
+  if (io_failed) {
+    printf("Failed to read or write some of the files.\n");
+  }
+  if (input_map) {
+    unmap_files();
+  }
+  trace_begin("log");
+  if (epoch_mode) {
+    epoch_flush();
+  } else {
+    log_counts();
+  }
+  log_flush();
+  trace_end("log");
+  if (show_stats) {
+    stats_print(stderr);
+  }
+  if (latency_enabled) {
+    latency_print(stderr);
+    if (epoch_mode) {
+      fprintf(stderr, "Resets are not measured in epoch mode, where nothing waits for them.\n");
+    }
+  }
+  return write_trace(trace_path) | io_failed;
 }
@@ -15,10 +15,10 @@
 
 FILE *input_file;
 FILE *output_file;
-int input_counts[256];
-int output_counts[256];
-int input_total_count;
-int output_total_count;
+long long input_counts[256];
+long long output_counts[256];
+long long input_total_count;
+long long output_total_count;
 int key = 1;
 int read_count = 0;
 sem_t *sem_char_read;
@@ -46,8 +46,8 @@ void *not_random_reset() {
 
 void init(char *inputFileName, char *outputFileName, char *logFileName) {
 	pthread_t pid;
-	sem_char_read = sem_open("/sem_char_read", O_CREAT, 0644, 0);
-	sem_unlink("/sem_char_read");
+	sem_char_read = (sem_t*) malloc(sizeof(sem_t));
+	sem_init(sem_char_read, 0, 0);
 	pthread_create(&pid, NULL, &not_random_reset, NULL);
 	input_file = fopen(inputFileName, "r");
 	output_file = fopen(outputFileName, "w");
@@ -88,18 +88,22 @@ void count_output(int c) {
 	output_total_count++;
 }
 
-int get_input_count(int c) {
+long long get_input_count(int c) {
 	return input_counts[toupper(c)];
 }
 
-int get_output_count(int c) {
+long long get_output_count(int c) {
 	return output_counts[toupper(c)];
 }
 
-int get_input_total_count() {
+long long get_input_total_count() {
 	return input_total_count;
 }
 
-int get_output_total_count() {
+long long get_output_total_count() {
 	return output_total_count;
 }
+
+int get_read_total_count() {
+	return read_count;
+}
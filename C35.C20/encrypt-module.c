@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "encrypt-module.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,101 +12,1002 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include "async-io.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ENCRYPT_SIMD
+#endif
+
+/* Bytes of mapped output written back per sync_file_range call. */
+#define MAP_FLUSH_SIZE (8 << 20)
+
+/* Stream mode: the stdio buffer size for the input and output, and the
+ * capacity asked for when either is a pipe. */
+#define STREAM_BUFFER_SIZE (1 << 16)
+#define STREAM_PIPE_SIZE (1 << 20)
 
 FILE *input_file;
 FILE *output_file;
 FILE *log_file;
-int input_counts[256];
-int output_counts[256];
-int input_total_count;
-int output_total_count;
+/* Number of interleaved sub-histograms per stream. Consecutive
+ * characters land in different tables, so a run of one character
+ * does not serialize on a single counter; the tables are summed
+ * when the counts are read or logged. */
+#define COUNT_TABLES 4
+
+typedef struct {
+	_Alignas(64) unsigned long long counts[COUNT_TABLES][256];
+	unsigned long long total;
+} Histogram;
+
+/* Written by different threads, so kept on separate cache lines. */
+Histogram input_hist;
+Histogram output_hist;
+
+/* Epoch mode: a ring of per-epoch histograms, indexed by epoch modulo
+ * epoch_slots. sides counts the streams that finished each epoch, and
+ * epoch_logged is the first epoch not yet written to the log. */
+typedef struct {
+	Histogram input;
+	Histogram output;
+	int sides;
+} EpochCounts;
+
+EpochCounts *epochs;
+int epoch_slots;
+long long epoch_logged;
+pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
 int key = 1;
 int read_count = 0;
+long long chars_read = 0;
+long long reset_base = 0;
+int chars_pending = 0;
 sem_t *sem_char_read;
+sem_t *sem_reset_done;
+char *mapped_input;
+char *mapped_output;
+long long map_length;
+long long output_written;
+/* Set by open_async_io: the block reads and writes then go through these. */
+AsyncFile *async_input;
+AsyncFile *async_output;
+
+/* Log blocks are snapshotted into a ring of LOG_QUEUE records by
+ * log_counts and the epoch logging, and formatted and written by the
+ * log thread, so the callers never wait on the formatting or the I/O
+ * unless the ring is full. log_head is the next record to fill and
+ * log_tail the next to write. */
+#define LOG_QUEUE 64
+
+/* Checksums of one segment of EPOCH_CHARS output characters: the CRC32C
+ * of the segment alone and of the output from the start to its end. */
+typedef struct {
+	unsigned segment;
+	unsigned stream;
+} Checksum;
+
+typedef struct {
+	int key;
+	/* Set once checksum holds the block's output checksums. */
+	int checksummed;
+	Checksum checksum;
+	unsigned long long input_total;
+	unsigned long long output_total;
+	unsigned long long input[256];
+	unsigned long long output[256];
+} LogRecord;
+
+enum { LOG_TEXT, LOG_SPARSE, LOG_BINARY };
+
+LogRecord log_queue[LOG_QUEUE];
+long long log_head;
+long long log_tail;
+int log_format = LOG_TEXT;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t log_room = PTHREAD_COND_INITIALIZER;
+
+/* With checksum_enable, the output tap hands the checksums of each finished
+ * segment to the log thread through a ring of CHECKSUM_QUEUE records, also
+ * guarded by log_mutex: checksum_head is the next segment to finish, and the
+ * log thread waits for segment log_tail before writing block log_tail. The
+ * tap waits if it gets CHECKSUM_QUEUE segments ahead of the log. The rest is
+ * the tap's own state for the segment in progress. */
+#define CHECKSUM_QUEUE 256
+#define CHECKSUM_BATCH 32
+
+int checksum_mode;
+Checksum checksum_queue[CHECKSUM_QUEUE];
+long long checksum_head;
+unsigned checksum_segment;
+unsigned checksum_stream;
+int checksum_fill;
 
 void clear_counts() {
-	memset(input_counts, 0, sizeof(input_counts));
-	memset(output_counts, 0, sizeof(output_counts));
-	input_total_count = 0;
-	output_total_count = 0;
+	memset(&input_hist, 0, sizeof(input_hist));
+	memset(&output_hist, 0, sizeof(output_hist));
 }
 
 void *random_reset() {
 	while (1) {
 		sem_wait(sem_char_read);
-		read_count++;
-		if (read_count == 200) {
+		read_count += __atomic_exchange_n(&chars_pending, 0, __ATOMIC_ACQ_REL);
+		while (read_count >= EPOCH_CHARS) {
 			reset_requested();
-			key += 5;
+			key += EPOCH_KEY_STEP;
 			clear_counts();
 			reset_finished();
-			read_count = 0;
+			read_count -= EPOCH_CHARS;
+			reset_base += EPOCH_CHARS;
+			sem_post(sem_reset_done);
 		}
 	}
 }
 
-void init(char *inputFileName, char *outputFileName, char *logFileName) {
-	pthread_t pid;
-	sem_char_read = sem_open("/sem_test_reset", O_CREAT, 0644, 0);
-	sem_unlink("/sem_test_reset");
+void *log_writer();
+
+void init_threads(char *logFileName) {
+	pthread_t pid, log_pid;
+	sem_char_read = (sem_t*) malloc(sizeof(sem_t));
+	sem_init(sem_char_read, 0, 0);
+	sem_reset_done = (sem_t*) malloc(sizeof(sem_t));
+	sem_init(sem_reset_done, 0, 0);
+	log_file = fopen(logFileName, "w");
 	pthread_create(&pid, NULL, &random_reset, NULL);
+	pthread_create(&log_pid, NULL, &log_writer, NULL);
+}
+
+void init(char *inputFileName, char *outputFileName, char *logFileName) {
 	input_file = fopen(inputFileName, "r");
-	output_file = fopen(outputFileName, "w");
-	log_file = fopen(logFileName, "w");
+	output_file = fopen(outputFileName, "w+");
+	init_threads(logFileName);
 }
 
-int read_input() {
+/* Give a stream larger stdio buffers and, if it is a pipe, a larger pipe,
+ * so the reads and writes of small blocks are batched into few syscalls. */
+void stream_buffer(FILE *f) {
+	setvbuf(f, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+#ifdef F_SETPIPE_SZ
+	struct stat st;
+	if (fstat(fileno(f), &st) == 0 && S_ISFIFO(st.st_mode)) {
+		fcntl(fileno(f), F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+	}
+#endif
+}
+
+int init_streams(int inputFd, int outputFd, char *logFileName) {
+	input_file = fdopen(inputFd, "r");
+	output_file = fdopen(outputFd, "w");
+	if (input_file == NULL || output_file == NULL) {
+		return -1;
+	}
+	stream_buffer(input_file);
+	stream_buffer(output_file);
+	init_threads(logFileName);
+	return 0;
+}
+
+void account_reads(int n) {
+	__atomic_add_fetch(&chars_pending, n, __ATOMIC_ACQ_REL);
 	sem_post(sem_char_read);
-	return fgetc(input_file);
+}
+
+int read_input() {
+	account_reads(1);
+	int c = fgetc(input_file);
+	if (c != EOF) {
+		__atomic_add_fetch(&chars_read, 1, __ATOMIC_RELEASE);
+	}
+	return c;
+}
+
+int reads_allowed(int n) {
+	if (chars_read > 0 && chars_read % EPOCH_CHARS == 0) {
+		sem_wait(sem_reset_done);
+	}
+	int room = EPOCH_CHARS - chars_read % EPOCH_CHARS;
+	return n < room ? n : room;
+}
+
+int read_input_block(char *buf, int n) {
+	n = reads_allowed(n);
+	int got = async_input ? async_read(async_input, buf, n) : (int) fread(buf, 1, n, input_file);
+	if (got > 0) {
+		__atomic_add_fetch(&chars_read, got, __ATOMIC_RELEASE);
+		account_reads(got);
+	}
+	return got;
+}
+
+long long map_files(char **input, char **output) {
+	struct stat st;
+	int in_fd = fileno(input_file);
+	int out_fd = fileno(output_file);
+	if (fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		return -1;
+	}
+	// The output is mapped read-write, which a descriptor inherited in
+	// stream mode may not allow
+	if ((fcntl(out_fd, F_GETFL) & O_ACCMODE) != O_RDWR) {
+		return -1;
+	}
+	if (ftruncate(out_fd, st.st_size) != 0) {
+		return -1;
+	}
+	mapped_input = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, in_fd, 0);
+	if (mapped_input == MAP_FAILED) {
+		ftruncate(out_fd, 0);
+		return -1;
+	}
+	mapped_output = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+	if (mapped_output == MAP_FAILED) {
+		munmap(mapped_input, st.st_size);
+		ftruncate(out_fd, 0);
+		return -1;
+	}
+	madvise(mapped_input, st.st_size, MADV_SEQUENTIAL);
+	madvise(mapped_output, st.st_size, MADV_SEQUENTIAL);
+	map_length = st.st_size;
+	*input = mapped_input;
+	*output = mapped_output;
+	return map_length;
+}
+
+int read_input_mapped(int n) {
+	n = reads_allowed(n);
+	if (n > map_length - chars_read) {
+		n = map_length - chars_read;
+	}
+	if (n > 0) {
+		__atomic_add_fetch(&chars_read, n, __ATOMIC_RELEASE);
+		account_reads(n);
+	}
+	return n;
+}
+
+void write_output_mapped(int n) {
+	long long start = output_written - output_written % MAP_FLUSH_SIZE;
+	output_written += n;
+	if (output_written - start >= MAP_FLUSH_SIZE || output_written == map_length) {
+#ifdef __linux__
+		sync_file_range(fileno(output_file), start, output_written - start, SYNC_FILE_RANGE_WRITE);
+#else
+		msync(mapped_output + start, output_written - start, MS_ASYNC);
+#endif
+	}
+}
+
+void unmap_files() {
+	munmap(mapped_input, map_length);
+	munmap(mapped_output, map_length);
 }
 
 void write_output(int c) {
 	fputc(c, output_file);
 }
 
+void write_output_block(const char *buf, int n) {
+	if (async_output) {
+		async_write(async_output, buf, n);
+		return;
+	}
+	fwrite(buf, 1, n, output_file);
+}
+
+int open_async_io() {
+	struct stat in_st, out_st;
+	if (fstat(fileno(input_file), &in_st) != 0 || !S_ISREG(in_st.st_mode) ||
+			fstat(fileno(output_file), &out_st) != 0 || !S_ISREG(out_st.st_mode)) {
+		return -1;
+	}
+	async_input = async_open(fileno(input_file), 0);
+	async_output = async_open(fileno(output_file), 1);
+	if (async_input == NULL || async_output == NULL) {
+		if (async_input) {
+			async_close(async_input);
+		}
+		if (async_output) {
+			async_close(async_output);
+		}
+		async_input = async_output = NULL;
+		return -1;
+	}
+	return async_uring(async_input) && async_uring(async_output);
+}
+
+int close_async_io() {
+	if (async_input == NULL) {
+		return 0;
+	}
+	int in = async_close(async_input), out = async_close(async_output);
+	async_input = async_output = NULL;
+	return in == 0 && out == 0 ? 0 : -1;
+}
+
 int encrypt(int c) {
 	return (c + key - 32) % 94 + 32;
 }
 
-void log_counts() {
-	fprintf(log_file, "Counts using key %d:\n", key);
-	fprintf(log_file, "Total input count: %d\n", input_total_count);
-	fprintf(log_file, "Plaintext frequency counts: [ %d", input_counts[0]);
+int get_key() {
+	return key;
+}
+
+void encrypt_block_scalar(const char *in, char *out, size_t n, int key) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = (in[i] + key - 32) % 94 + 32;
+	}
+}
+
+#ifdef ENCRYPT_SIMD
+/* Once key >= 160, c + key - 32 is never negative for any char c, so the key
+ * can be reduced mod 94 (staying >= 160) without changing any result. With c
+ * in [-128, 127] and the reduced key in [0, 253], c + key - 32 stays within
+ * [-128 + 0 - 32, 127 + 253 - 32] = [-160, 348], which fits the 16-bit lanes
+ * below.
+ */
+int encrypt_lane_key(int key) {
+	return key >= 160 ? 160 + (key - 160) % 94 : key;
+}
+
+/* (x % 94) with C's truncating division for eight 16-bit lanes with
+ * |x| < 376: the magnitude is reduced by comparing and subtracting 188 and
+ * then 94, and the sign of x is put back afterwards.
+ */
+static inline __m128i encrypt_mod94_sse2(__m128i x) {
+	__m128i neg = _mm_cmpgt_epi16(_mm_setzero_si128(), x);
+	__m128i a = _mm_sub_epi16(_mm_xor_si128(x, neg), neg);
+	a = _mm_sub_epi16(a, _mm_and_si128(_mm_cmpgt_epi16(a, _mm_set1_epi16(187)), _mm_set1_epi16(188)));
+	a = _mm_sub_epi16(a, _mm_and_si128(_mm_cmpgt_epi16(a, _mm_set1_epi16(93)), _mm_set1_epi16(94)));
+	return _mm_sub_epi16(_mm_xor_si128(a, neg), neg);
+}
+
+void encrypt_block_sse2(const char *in, char *out, size_t n, int key) {
+	if (key < 0) {
+		encrypt_block_scalar(in, out, n, key);
+		return;
+	}
+	__m128i k = _mm_set1_epi16(encrypt_lane_key(key) - 32);
+	__m128i base = _mm_set1_epi16(32);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		// Sign-extend the bytes to 16 bits by placing each in a lane's high half
+		__m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+		__m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+		lo = _mm_add_epi16(encrypt_mod94_sse2(_mm_add_epi16(lo, k)), base);
+		hi = _mm_add_epi16(encrypt_mod94_sse2(_mm_add_epi16(hi, k)), base);
+		_mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi16(lo, hi));
+	}
+	encrypt_block_scalar(in + i, out + i, n - i, key);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i encrypt_mod94_avx2(__m256i x) {
+	__m256i neg = _mm256_cmpgt_epi16(_mm256_setzero_si256(), x);
+	__m256i a = _mm256_abs_epi16(x);
+	a = _mm256_sub_epi16(a, _mm256_and_si256(_mm256_cmpgt_epi16(a, _mm256_set1_epi16(187)), _mm256_set1_epi16(188)));
+	a = _mm256_sub_epi16(a, _mm256_and_si256(_mm256_cmpgt_epi16(a, _mm256_set1_epi16(93)), _mm256_set1_epi16(94)));
+	return _mm256_sub_epi16(_mm256_xor_si256(a, neg), neg);
+}
+
+__attribute__((target("avx2")))
+void encrypt_block_avx2(const char *in, char *out, size_t n, int key) {
+	if (key < 0) {
+		encrypt_block_scalar(in, out, n, key);
+		return;
+	}
+	__m256i k = _mm256_set1_epi16(encrypt_lane_key(key) - 32);
+	__m256i base = _mm256_set1_epi16(32);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+		__m256i lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(v));
+		__m256i hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(v, 1));
+		lo = _mm256_add_epi16(encrypt_mod94_avx2(_mm256_add_epi16(lo, k)), base);
+		hi = _mm256_add_epi16(encrypt_mod94_avx2(_mm256_add_epi16(hi, k)), base);
+		// packs works within 128-bit lanes, so restore the byte order afterwards
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+		_mm256_storeu_si256((__m256i *) (out + i), packed);
+	}
+	encrypt_block_sse2(in + i, out + i, n - i, key);
+}
+#endif
+
+void encrypt_block(const char *in, char *out, size_t n, int key) {
+#ifdef ENCRYPT_SIMD
+	if (__builtin_cpu_supports("avx2")) {
+		encrypt_block_avx2(in, out, n, key);
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		encrypt_block_sse2(in, out, n, key);
+		return;
+	}
+#endif
+	encrypt_block_scalar(in, out, n, key);
+}
+
+unsigned long long hist_count(Histogram *h, int c) {
+	unsigned long long sum = 0;
+	for (int t = 0; t < COUNT_TABLES; t++) {
+		sum += h->counts[t][(unsigned char) c];
+	}
+	return sum;
+}
+
+/* Sum the tables of both histograms into rec. */
+void log_snapshot(LogRecord *rec, int key, Histogram *input, Histogram *output) {
+	rec->key = key;
+	rec->checksummed = 0;
+	rec->input_total = input->total;
+	rec->output_total = output->total;
+	for (int i = 0; i < 256; i++) {
+		rec->input[i] = hist_count(input, i);
+		rec->output[i] = hist_count(output, i);
+	}
+}
+
+void log_write_varint(FILE *f, unsigned long long v) {
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+void log_write_sparse(FILE *f, unsigned long long *counts) {
+	for (int i = 0; i < 256; i++) {
+		if (counts[i] > 0) {
+			fprintf(f, " %d:%llu", i, counts[i]);
+		}
+	}
+}
+
+void log_write_binary(FILE *f, unsigned long long *counts) {
+	int used = 0;
+	for (int i = 0; i < 256; i++) {
+		used += counts[i] > 0;
+	}
+	log_write_varint(f, used);
+	for (int i = 0; i < 256; i++) {
+		if (counts[i] > 0) {
+			fputc(i, f);
+			log_write_varint(f, counts[i]);
+		}
+	}
+}
+
+/* Write one log block in the format chosen with set_log_format. */
+void log_write(FILE *f, LogRecord *rec) {
+	if (log_format == LOG_SPARSE) {
+		fprintf(f, "Counts using key %d: input %llu", rec->key, rec->input_total);
+		log_write_sparse(f, rec->input);
+		fprintf(f, " output %llu", rec->output_total);
+		log_write_sparse(f, rec->output);
+		if (rec->checksummed) {
+			fprintf(f, " crc32c %08x %08x", rec->checksum.segment, rec->checksum.stream);
+		}
+		fprintf(f, "\n");
+		return;
+	}
+	if (log_format == LOG_BINARY) {
+		log_write_varint(f, rec->key);
+		log_write_varint(f, rec->input_total);
+		log_write_binary(f, rec->input);
+		log_write_varint(f, rec->output_total);
+		log_write_binary(f, rec->output);
+		if (rec->checksummed) {
+			log_write_varint(f, rec->checksum.segment);
+			log_write_varint(f, rec->checksum.stream);
+		}
+		return;
+	}
+	fprintf(f, "Counts using key %d:\n", rec->key);
+	fprintf(f, "Total input count: %llu\n", rec->input_total);
+	fprintf(f, "Plaintext frequency counts: [ %llu", rec->input[0]);
 	for (int i=1; i<256; i++) {
-		fprintf(log_file, ", %d", input_counts[i]);
+		fprintf(f, ", %llu", rec->input[i]);
 	}
-	fprintf(log_file, "]\n");
-	fprintf(log_file, "Total output count: %d\n", output_total_count);
-	fprintf(log_file, "Ciphertext frequency counts: [ %d", output_counts[0]);
+	fprintf(f, "]\n");
+	fprintf(f, "Total output count: %llu\n", rec->output_total);
+	fprintf(f, "Ciphertext frequency counts: [ %llu", rec->output[0]);
 	for (int i=1; i<256; i++) {
-		fprintf(log_file, ", %d", output_counts[i]);
+		fprintf(f, ", %llu", rec->output[i]);
+	}
+	fprintf(f, "]\n");
+	if (rec->checksummed) {
+		fprintf(f, "Ciphertext CRC32C: %08x (stream %08x)\n", rec->checksum.segment, rec->checksum.stream);
+	}
+	fprintf(f, "\n");
+}
+
+void log_histograms(FILE *f, int key, Histogram *input, Histogram *output) {
+	LogRecord rec;
+	log_snapshot(&rec, key, input, output);
+	log_write(f, &rec);
+}
+
+/* Snapshot a log block into the queue for the log thread, waiting only
+ * if the queue is full. */
+void log_enqueue(int key, Histogram *input, Histogram *output) {
+	pthread_mutex_lock(&log_mutex);
+	while (log_head - log_tail == LOG_QUEUE) {
+		pthread_cond_wait(&log_room, &log_mutex);
 	}
-	fprintf(log_file, "]\n\n");
+	log_snapshot(&log_queue[log_head % LOG_QUEUE], key, input, output);
+	log_head++;
+	pthread_cond_signal(&log_ready);
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/* Body of the log thread: writes the queued blocks in order. */
+void *log_writer() {
+	pthread_mutex_lock(&log_mutex);
+	while (1) {
+		while (log_tail == log_head) {
+			pthread_cond_wait(&log_ready, &log_mutex);
+		}
+		LogRecord *rec = &log_queue[log_tail % LOG_QUEUE];
+		if (checksum_mode) {
+			while (checksum_head == log_tail) {
+				pthread_cond_wait(&log_ready, &log_mutex);
+			}
+			rec->checksum = checksum_queue[log_tail % CHECKSUM_QUEUE];
+			rec->checksummed = 1;
+		}
+		pthread_mutex_unlock(&log_mutex);
+		log_write(log_file, rec);
+		pthread_mutex_lock(&log_mutex);
+		log_tail++;
+		pthread_cond_broadcast(&log_room);
+	}
+}
+
+int set_log_format(const char *name) {
+	if (strcmp(name, "text") == 0) {
+		log_format = LOG_TEXT;
+	} else if (strcmp(name, "sparse") == 0) {
+		log_format = LOG_SPARSE;
+	} else if (strcmp(name, "binary") == 0) {
+		log_format = LOG_BINARY;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+void log_counts() {
+	log_enqueue(key, &input_hist, &output_hist);
+}
+
+void log_flush() {
+	pthread_mutex_lock(&log_mutex);
+	while (log_tail != log_head) {
+		pthread_cond_wait(&log_room, &log_mutex);
+	}
+	fflush(log_file);
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/* Table for crc32c_table, built on first use: entry i is the CRC32C
+ * (reflected polynomial 0x82F63B78) of the byte i. */
+unsigned crc32c_lookup[256];
+pthread_once_t crc32c_lookup_once = PTHREAD_ONCE_INIT;
+
+void crc32c_build_lookup() {
+	for (unsigned i = 0; i < 256; i++) {
+		unsigned c = i;
+		for (int b = 0; b < 8; b++) {
+			c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+		}
+		crc32c_lookup[i] = c;
+	}
+}
+
+unsigned crc32c_table(unsigned crc, const char *buf, size_t n) {
+	pthread_once(&crc32c_lookup_once, &crc32c_build_lookup);
+	crc = ~crc;
+	for (size_t i = 0; i < n; i++) {
+		crc = crc32c_lookup[(crc ^ (unsigned char) buf[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#if defined(ENCRYPT_SIMD) && defined(__x86_64__)
+/* The crc32 instruction takes 8 bytes at a time; the unaligned head and
+ * the tail go a byte at a time. */
+__attribute__((target("sse4.2")))
+unsigned crc32c_sse42(unsigned crc, const char *buf, size_t n) {
+	unsigned long long c = ~crc;
+	for (; n > 0 && ((size_t) buf & 7) != 0; n--) {
+		c = _mm_crc32_u8(c, *buf++);
+	}
+	for (; n >= 8; n -= 8, buf += 8) {
+		unsigned long long v;
+		memcpy(&v, buf, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	for (; n > 0; n--) {
+		c = _mm_crc32_u8(c, *buf++);
+	}
+	return ~c;
+}
+#endif
+
+unsigned crc32c(unsigned crc, const char *buf, size_t n) {
+#if defined(ENCRYPT_SIMD) && defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return crc32c_sse42(crc, buf, n);
+	}
+#endif
+	return crc32c_table(crc, buf, n);
+}
+
+void checksum_enable() {
+	checksum_mode = 1;
+}
+
+/* Hand n finished segments to the log thread, waiting while the ring is
+ * full. */
+void checksum_publish(const Checksum *done, int n) {
+	if (n == 0) {
+		return;
+	}
+	pthread_mutex_lock(&log_mutex);
+	for (int i = 0; i < n; i++) {
+		while (checksum_head - log_tail == CHECKSUM_QUEUE) {
+			pthread_cond_wait(&log_room, &log_mutex);
+		}
+		checksum_queue[checksum_head % CHECKSUM_QUEUE] = done[i];
+		checksum_head++;
+	}
+	pthread_cond_signal(&log_ready);
+	pthread_mutex_unlock(&log_mutex);
+}
+
+void checksum_output(const char *buf, int n) {
+	Checksum done[CHECKSUM_BATCH];
+	int finished = 0;
+	while (n > 0) {
+		int k = EPOCH_CHARS - checksum_fill;
+		if (k > n) {
+			k = n;
+		}
+		checksum_segment = crc32c(checksum_segment, buf, k);
+		checksum_stream = crc32c(checksum_stream, buf, k);
+		checksum_fill += k;
+		buf += k;
+		n -= k;
+		if (checksum_fill == EPOCH_CHARS) {
+			done[finished].segment = checksum_segment;
+			done[finished].stream = checksum_stream;
+			checksum_segment = 0;
+			checksum_fill = 0;
+			if (++finished == CHECKSUM_BATCH) {
+				checksum_publish(done, finished);
+				finished = 0;
+			}
+		}
+	}
+	checksum_publish(done, finished);
+}
+
+unsigned checksum_finish() {
+	Checksum last = { checksum_segment, checksum_stream };
+	checksum_publish(&last, 1);
+	return checksum_stream;
+}
+
+void hist_add_block(Histogram *h, const char *buf, int n) {
+	const unsigned char *b = (const unsigned char *) buf;
+	int i = 0;
+	for (; i + COUNT_TABLES <= n; i += COUNT_TABLES) {
+		h->counts[0][b[i]]++;
+		h->counts[1][b[i + 1]]++;
+		h->counts[2][b[i + 2]]++;
+		h->counts[3][b[i + 3]]++;
+	}
+	for (; i < n; i++) {
+		h->counts[0][b[i]]++;
+	}
+	h->total += n;
 }
 
 void count_input(int c) {
-	input_counts[c]++;
-	input_total_count++;
+	input_hist.counts[0][(unsigned char) c]++;
+	input_hist.total++;
 }
 
 void count_output(int c) {
-	output_counts[c]++;
-	output_total_count++;
+	output_hist.counts[0][(unsigned char) c]++;
+	output_hist.total++;
+}
+
+void count_input_block(const char *buf, int n) {
+	hist_add_block(&input_hist, buf, n);
+}
+
+void count_output_block(const char *buf, int n) {
+	hist_add_block(&output_hist, buf, n);
+}
+
+int epoch_init(int slots) {
+	epochs = aligned_alloc(_Alignof(EpochCounts), slots * sizeof(EpochCounts));
+	if (epochs == NULL) {
+		return -1;
+	}
+	memset(epochs, 0, slots * sizeof(EpochCounts));
+	epoch_slots = slots;
+	epoch_logged = 0;
+	return 0;
+}
+
+int epoch_key(long long epoch) {
+	return 1 + EPOCH_KEY_STEP * epoch;
+}
+
+void count_input_epoch(long long epoch, const char *buf, int n) {
+	hist_add_block(&epochs[epoch % epoch_slots].input, buf, n);
+}
+
+void count_output_epoch(long long epoch, const char *buf, int n) {
+	hist_add_block(&epochs[epoch % epoch_slots].output, buf, n);
+}
+
+/* Log the epochs from epoch_logged up to (not including) end that both
+ * streams have finished, or all of them if force is set, clearing each slot
+ * for reuse. Must be called with epoch_mutex held. */
+void log_epochs(long long end, int force) {
+	while (epoch_logged < end) {
+		EpochCounts *ec = &epochs[epoch_logged % epoch_slots];
+		if (!force && ec->sides < 2) {
+			break;
+		}
+		log_enqueue(epoch_key(epoch_logged), &ec->input, &ec->output);
+		memset(ec, 0, sizeof(EpochCounts));
+		epoch_logged++;
+	}
+}
+
+void epoch_finished(long long epoch) {
+	pthread_mutex_lock(&epoch_mutex);
+	epochs[epoch % epoch_slots].sides++;
+	log_epochs(epoch + 1, 0);
+	pthread_mutex_unlock(&epoch_mutex);
+}
+
+void epoch_flush() {
+	pthread_mutex_lock(&epoch_mutex);
+	log_epochs(__atomic_load_n(&chars_read, __ATOMIC_ACQUIRE) / EPOCH_CHARS + 1, 1);
+	pthread_mutex_unlock(&epoch_mutex);
+	free(epochs);
+}
+
+struct RangeLog {
+	Histogram input;
+	Histogram output;
+	FILE *file;
+	/* Set if file is the log itself rather than a temporary file. */
+	int direct;
+};
+
+long long input_file_size() {
+	struct stat st;
+	if (fstat(fileno(input_file), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+	long long size = st.st_size;
+	if (fstat(fileno(output_file), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+	return size;
+}
+
+int read_input_range(char *buf, long long offset, int n) {
+	return async_pread_full(fileno(input_file), buf, n, offset);
+}
+
+int write_output_range(const char *buf, long long offset, int n) {
+	return async_pwrite_full(fileno(output_file), buf, n, offset);
+}
+
+RangeLog *range_log_open() {
+	RangeLog *rl = aligned_alloc(_Alignof(RangeLog), sizeof(RangeLog));
+	if (rl == NULL) {
+		return NULL;
+	}
+	memset(rl, 0, sizeof(RangeLog));
+	rl->file = tmpfile();
+	if (rl->file == NULL) {
+		free(rl);
+		return NULL;
+	}
+	return rl;
+}
+
+void range_log_count(RangeLog *rl, const char *in, const char *out, int n) {
+	hist_add_block(&rl->input, in, n);
+	hist_add_block(&rl->output, out, n);
+}
+
+void range_log_epoch(RangeLog *rl, long long epoch) {
+	log_histograms(rl->file, epoch_key(epoch), &rl->input, &rl->output);
+	memset(&rl->input, 0, sizeof(Histogram));
+	memset(&rl->output, 0, sizeof(Histogram));
+}
+
+/* Append everything logged to rl to f and free rl. */
+void range_log_copy(RangeLog *rl, FILE *f) {
+	char buf[1 << 16];
+	size_t n;
+	if (rl->direct) {
+		free(rl);
+		return;
+	}
+	rewind(rl->file);
+	while ((n = fread(buf, 1, sizeof(buf), rl->file)) > 0) {
+		fwrite(buf, 1, n, f);
+	}
+	fclose(rl->file);
+	free(rl);
+}
+
+void range_log_close(RangeLog *rl) {
+	log_flush();
+	range_log_copy(rl, log_file);
+}
+
+struct BatchFile {
+	int input;
+	int output;
+	FILE *log;
+	long long size;
+};
+
+BatchFile *batch_open(const char *inputFileName, const char *outputFileName, const char *logFileName) {
+	BatchFile *bf = malloc(sizeof(BatchFile));
+	struct stat st;
+	if (bf == NULL) {
+		return NULL;
+	}
+	bf->input = open(inputFileName, O_RDONLY);
+	bf->output = -1;
+	bf->log = NULL;
+	if (bf->input < 0 || fstat(bf->input, &st) != 0 || !S_ISREG(st.st_mode)) {
+		batch_close(bf);
+		return NULL;
+	}
+	bf->size = st.st_size;
+	bf->output = open(outputFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bf->log = fopen(logFileName, "w");
+	if (bf->output < 0 || bf->log == NULL) {
+		batch_close(bf);
+		return NULL;
+	}
+	return bf;
+}
+
+long long batch_size(BatchFile *bf) {
+	return bf->size;
+}
+
+int batch_read_range(BatchFile *bf, char *buf, long long offset, int n) {
+	return async_pread_full(bf->input, buf, n, offset);
+}
+
+int batch_write_range(BatchFile *bf, const char *buf, long long offset, int n) {
+	return async_pwrite_full(bf->output, buf, n, offset);
+}
+
+RangeLog *batch_log_open(BatchFile *bf) {
+	RangeLog *rl = aligned_alloc(_Alignof(RangeLog), sizeof(RangeLog));
+	if (rl == NULL) {
+		return NULL;
+	}
+	memset(rl, 0, sizeof(RangeLog));
+	rl->file = bf->log;
+	rl->direct = 1;
+	return rl;
+}
+
+void batch_log(BatchFile *bf, RangeLog *rl) {
+	range_log_copy(rl, bf->log);
+}
+
+int batch_close(BatchFile *bf) {
+	int error = 0;
+	if (bf->input >= 0) {
+		close(bf->input);
+	}
+	if (bf->output >= 0) {
+		error |= close(bf->output) != 0;
+	}
+	if (bf->log != NULL) {
+		error |= fclose(bf->log) != 0;
+	}
+	free(bf);
+	return error ? -1 : 0;
+}
+
+struct Session {
+	Histogram input;
+	Histogram output;
+	long long offset;
+	FILE *log;
+	char *log_text;
+	size_t log_size;
+};
+
+Session *session_open() {
+	Session *s = aligned_alloc(_Alignof(Session), sizeof(Session));
+	if (s == NULL) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(Session));
+	s->log = open_memstream(&s->log_text, &s->log_size);
+	if (s->log == NULL) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+void session_encrypt(Session *s, const char *in, char *out, int n) {
+	for (int done = 0; done < n;) {
+		long long epoch = s->offset / EPOCH_CHARS;
+		int room = EPOCH_CHARS - s->offset % EPOCH_CHARS;
+		int k = n - done < room ? n - done : room;
+		encrypt_block(in + done, out + done, k, epoch_key(epoch));
+		hist_add_block(&s->input, in + done, k);
+		hist_add_block(&s->output, out + done, k);
+		done += k;
+		s->offset += k;
+		if (s->offset % EPOCH_CHARS == 0) {
+			log_histograms(s->log, epoch_key(epoch), &s->input, &s->output);
+			memset(&s->input, 0, sizeof(Histogram));
+			memset(&s->output, 0, sizeof(Histogram));
+		}
+	}
+}
+
+void session_finish(Session *s) {
+	log_histograms(s->log, epoch_key(s->offset / EPOCH_CHARS), &s->input, &s->output);
+}
+
+size_t session_log(Session *s, const char **text) {
+	fflush(s->log);
+	*text = s->log_text;
+	size_t n = s->log_size;
+	// The next flush then reports only what is logged from here on
+	rewind(s->log);
+	return n;
+}
+
+void session_close(Session *s) {
+	fclose(s->log);
+	free(s->log_text);
+	free(s);
+}
+
+long long get_input_count(int c) {
+	return hist_count(&input_hist, c);
 }
 
-int get_input_count(int c) {
-	return input_counts[c];
+long long get_output_count(int c) {
+	return hist_count(&output_hist, c);
 }
 
-int get_output_count(int c) {
-	return output_counts[c];
+int get_read_total_count() {
+	long long r = __atomic_load_n(&chars_read, __ATOMIC_ACQUIRE) - reset_base;
+	return r < EPOCH_CHARS ? r : EPOCH_CHARS;
 }
 
-int get_input_total_count() {
-	return input_total_count;
+long long get_input_total_count() {
+	return input_hist.total;
 }
 
-int get_output_total_count() {
-	return output_total_count;
+long long get_output_total_count() {
+	return output_hist.total;
 }
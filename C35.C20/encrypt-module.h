@@ -1,29 +1,203 @@
-#ifndef ENCRYPT_H
-#define ENCRYPT_H
-
-/* You must implement this function.
- * When the function returns the encryption module is allowed to reset.
- */
-void reset_requested();
-/* You must implement this function.
- * The function is called after the encryption module has finished a reset.
- */
-void reset_finished();
-
-/* You must use these functions to perform all I/O, encryption and counting
- * operations.
- */
-void init(char *inputFileName, char *outputFileName, char *logFileName);
-int read_input();
-void write_output(int c);
-void log_counts();
-int encrypt(int c);
-void count_input(int c);
-void count_output(int c);
-int get_input_count(int c);
-int get_output_count(int c);
-int get_input_total_count();
-int get_output_total_count();
-
-#endif // ENCRYPT_H
-
+#ifndef ENCRYPT_H
+#define ENCRYPT_H
+
+#include <stddef.h>
+
+/* The module resets after every EPOCH_CHARS characters read, adding
+ * EPOCH_KEY_STEP to the key. */
+#define EPOCH_CHARS 200
+#define EPOCH_KEY_STEP 5
+
+/* You must implement this function.
+ * When the function returns the encryption module is allowed to reset.
+ */
+void reset_requested();
+/* You must implement this function.
+ * The function is called after the encryption module has finished a reset.
+ */
+void reset_finished();
+
+/* You must use these functions to perform all I/O, encryption and counting
+ * operations.
+ */
+void init(char *inputFileName, char *outputFileName, char *logFileName);
+int read_input();
+void write_output(int c);
+void log_counts();
+
+/* Logging runs in the background: log_counts (and the epoch logging below)
+ * only snapshot the counts into a queue, which a log thread formats and
+ * writes in order. log_flush waits until everything logged so far is written
+ * to the log file. set_log_format picks the format of the log blocks and
+ * returns 0, or -1 for an unknown name:
+ *   text    the default, a block of five lines per reset
+ *   sparse  one line per reset listing only the non-zero counts as
+ *           character:count pairs
+ *   binary  per reset, as unsigned LEB128 varints: the key, the input total,
+ *           the number of non-zero input counts followed by a byte for the
+ *           character and a varint count for each, then the same for the
+ *           output
+ */
+int set_log_format(const char *name);
+void log_flush();
+
+/* Stream mode, an alternative to init for use in a pipeline.
+ * init_streams reads the input from and writes the output to the given open
+ * file descriptors (such as 0 and 1) and returns 0, or -1 if either cannot
+ * be used. Both get large stdio buffers, and pipes are enlarged where the
+ * kernel allows, so the small blocks between resets are still read and
+ * written in large system calls.
+ */
+int init_streams(int inputFd, int outputFd, char *logFileName);
+
+/* Asynchronous block I/O for regular files.
+ * open_async_io makes read_input_block and write_output_block go through a
+ * few 256 KB chunks kept in flight at once: reads run ahead of the reader and
+ * full chunks are written while the next one fills. It uses io_uring with
+ * registered buffers and returns 1, or falls back to pread/pwrite with
+ * posix_fadvise readahead hints and returns 0. It returns -1, changing
+ * nothing, if the input or output is not a regular file. It must be called
+ * before any I/O. close_async_io waits for every write to reach the output
+ * file and returns 0, or -1 if any read or write failed.
+ */
+int open_async_io();
+int close_async_io();
+
+/* Block variants of read_input and write_output.
+ * read_input_block reads up to n characters into buf and returns how many
+ * were read, or 0 at end of file. A block never extends past the next reset
+ * point, and reading past a reset point waits for that reset to finish, so a
+ * reset still happens after every 200 characters read. The whole block is
+ * reported to the reset thread at once.
+ */
+int read_input_block(char *buf, int n);
+void write_output_block(const char *buf, int n);
+
+/* Zero-copy mode for regular files.
+ * map_files maps the input file and an output file pre-sized to the same
+ * length, and returns that length, or -1 if the input is not a non-empty
+ * regular file (callers then fall back to the block functions above).
+ * read_input_mapped claims up to n more characters of the mapped input with
+ * the same reset behaviour as read_input_block and returns how many, or 0 at
+ * end of file; the characters are at input + (total claimed so far).
+ * write_output_mapped marks n more characters of the mapped output as final
+ * and starts writing them back to the file.
+ */
+long long map_files(char **input, char **output);
+int read_input_mapped(int n);
+void write_output_mapped(int n);
+void unmap_files();
+int encrypt(int c);
+
+/* Block variant of encrypt.
+ * encrypt_block writes the encryption of the n characters at in to out using
+ * the given key, with the same result as calling encrypt on each of them.
+ * It picks the widest SIMD kernel the CPU supports at run time; the kernels
+ * are also exported on x86 so they can be benchmarked against each other.
+ */
+void encrypt_block(const char *in, char *out, size_t n, int key);
+void encrypt_block_scalar(const char *in, char *out, size_t n, int key);
+#if defined(__x86_64__) || defined(__i386__)
+void encrypt_block_sse2(const char *in, char *out, size_t n, int key);
+void encrypt_block_avx2(const char *in, char *out, size_t n, int key);
+#endif
+/* The key currently in use by encrypt. */
+int get_key();
+void count_input(int c);
+void count_output(int c);
+/* Block variants of count_input and count_output: count each of the n
+ * characters in buf. The counts are kept in 64-bit counters. */
+void count_input_block(const char *buf, int n);
+void count_output_block(const char *buf, int n);
+long long get_input_count(int c);
+long long get_output_count(int c);
+long long get_input_total_count();
+long long get_output_total_count();
+/* Epoch mode, an alternative to draining the pipeline on every reset.
+ * Epoch e covers characters [e * EPOCH_CHARS, (e + 1) * EPOCH_CHARS) of the
+ * stream and is encrypted with epoch_key(e), the key the module uses after
+ * e resets. epoch_init allocates per-epoch histograms for up to slots epochs
+ * in flight and returns 0, or -1 if out of memory. count_input_epoch and
+ * count_output_epoch count a block that lies within one epoch. Each counter
+ * calls epoch_finished once it has counted the whole of an epoch; epochs
+ * that both counters finished are logged in order, in the same format as
+ * log_counts. epoch_flush logs the remaining epochs at end of file.
+ */
+int epoch_init(int slots);
+int epoch_key(long long epoch);
+void count_input_epoch(long long epoch, const char *buf, int n);
+void count_output_epoch(long long epoch, const char *buf, int n);
+void epoch_finished(long long epoch);
+void epoch_flush();
+/* Range mode: the size of the input, or -1 if the input or the output is
+ * not a regular file. */
+typedef struct RangeLog RangeLog;
+long long input_file_size();
+/* Read n characters at offset, fewer only at end of file; -1 on error.
+ * Neither this nor write_output_range triggers a reset. */
+int read_input_range(char *buf, long long offset, int n);
+/* Write all n characters at offset; returns 0, or -1 on error. */
+int write_output_range(const char *buf, long long offset, int n);
+/* A RangeLog collects the log blocks of one range; NULL if out of memory. */
+RangeLog *range_log_open();
+/* Count a block of input and its output into the current epoch. */
+void range_log_count(RangeLog *rl, const char *in, const char *out, int n);
+/* Log the current epoch with epoch_key(epoch) and start the next. */
+void range_log_epoch(RangeLog *rl, long long epoch);
+/* Append rl to the log file and free it; close ranges in order. */
+void range_log_close(RangeLog *rl);
+/* Batch mode: a BatchFile is one input, output and log triple with its own
+ * key schedule and counts, so any number can be worked on at once. */
+typedef struct BatchFile BatchFile;
+/* NULL if a file cannot be opened, the input is not regular or out of memory. */
+BatchFile *batch_open(const char *inputFileName, const char *outputFileName, const char *logFileName);
+long long batch_size(BatchFile *bf);
+/* Like read_input_range and write_output_range, on the BatchFile. */
+int batch_read_range(BatchFile *bf, char *buf, long long offset, int n);
+int batch_write_range(BatchFile *bf, const char *buf, long long offset, int n);
+/* A RangeLog writing straight to the file's log, for a single range. */
+RangeLog *batch_log_open(BatchFile *bf);
+/* Append rl to the file's log and free it. */
+void batch_log(BatchFile *bf, RangeLog *rl);
+/* Close the files and free bf; returns 0, or -1 if a write failed. */
+int batch_close(BatchFile *bf);
+/* Session mode, for encrypting streams that arrive in pieces, such as
+ * connections to a service, without init. A Session is one stream with its
+ * own key schedule and counts, giving the same ciphertext and log as a run on
+ * the whole stream. session_open returns a new Session, or NULL if out of
+ * memory. session_encrypt encrypts the next n characters of the stream from
+ * in to out, logging each epoch it completes. session_finish logs the final
+ * (partial or empty) epoch at end of stream. session_log points text at what
+ * was logged since the previous call and returns its length; the text stays
+ * valid until the next call on the Session. session_close frees the Session.
+ */
+typedef struct Session Session;
+Session *session_open();
+void session_encrypt(Session *s, const char *in, char *out, int n);
+void session_finish(Session *s);
+size_t session_log(Session *s, const char **text);
+void session_close(Session *s);
+/* Output checksums, for checking the ciphertext end to end without a second
+ * pass over it. crc32c extends crc (0 to start) with the CRC32C of the n
+ * bytes at buf, using the SSE4.2 crc32 instruction where the CPU has it and a
+ * table otherwise. After checksum_enable, every block the log thread writes
+ * also records the CRC32C of the output characters of its segment (the
+ * output of the characters read since the previous block) and of the whole
+ * output up to the segment's end: as a "Ciphertext CRC32C" line in the text
+ * format, " crc32c <segment> <stream>" in hex at the end of a sparse line,
+ * and two more varints in the binary format. checksum_output must then be
+ * given the whole output stream in order, as it is produced, and
+ * checksum_finish called at end of stream; it returns the CRC32C of the
+ * whole output. The log thread waits for the checksums of each block, and
+ * checksum_output waits if it gets 256 segments ahead of the log.
+ * Only the pipeline modes log through the log thread.
+ */
+unsigned crc32c(unsigned crc, const char *buf, size_t n);
+void checksum_enable();
+void checksum_output(const char *buf, int n);
+unsigned checksum_finish();
+/* Number of characters read since the last reset (at most 200). */
+int get_read_total_count();
+
+#endif // ENCRYPT_H
+
@@ -0,0 +1,279 @@
+/**********************************************************
+ * This header implements the encryption service: a       *
+ * daemon listening on a Unix domain socket, where every  *
+ * connection is a session with its own key schedule and  *
+ * counts (see Session in `encrypt-module.h`). One epoll  *
+ * loop watches all the connections and hands each one    *
+ * that is ready to a small work-stealing pool, which     *
+ * reads, encrypts and answers a chunk at a time.         *
+ *                                                        *
+ * Protocol: the client writes its plaintext and shuts    *
+ * down its side for writing at the end. The service      *
+ * answers with frames of a type byte, a 4-byte little-   *
+ * endian length and that many bytes: 'C' frames carry    *
+ * the ciphertext and 'L' frames the log, each in order,  *
+ * as a run of `encrypt` would write them. The service    *
+ * closes the connection after the last frame.            *
+ **********************************************************/
+#ifndef ENCRYPT_SERVICE_H
+#define ENCRYPT_SERVICE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#define encrypt encrypt_unistd
+#include <unistd.h>
+#undef encrypt
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include "encrypt-module.h"
+#include "work-pool.h"
+
+/**
+ * Plaintext read from a connection per step; a connection that
+ * has more gets back in line behind the others.
+ */
+#define SERVICE_CHUNK 65536
+#define SERVICE_EVENTS 64
+#define FRAME_HEADER 5
+
+/**
+ * One client connection. `out` holds the frames not yet sent, from
+ * `out_sent` up to `out_len`. Only one worker handles a connection
+ * at a time, since it is watched with EPOLLONESHOT and only
+ * re-armed at the end of a step.
+ */
+typedef struct {
+  PoolTask task;
+  int fd;
+  int epoll;
+  int eof;
+  Session *session;
+  char *out;
+  size_t out_len;
+  size_t out_sent;
+  size_t out_cap;
+} Connection;
+
+/**
+ * Make room for a frame of `n` bytes at the end of `c->out`, write
+ * its header and return where its payload goes, or NULL (leaving
+ * `c->out` as it was) if out of memory.
+ */
+char *service_frame(Connection *c, char type, size_t n) {
+  if (c->out_len + FRAME_HEADER + n > c->out_cap) {
+    size_t cap = (c->out_len + FRAME_HEADER + n) * 2;
+    char *out = realloc(c->out, cap);
+    if (out == NULL) {
+      return NULL;
+    }
+    c->out = out;
+    c->out_cap = cap;
+  }
+  char *frame = c->out + c->out_len;
+  frame[0] = type;
+  for (int i = 0; i < 4; i++) {
+    frame[1 + i] = (n >> (8 * i)) & 0xff;
+  }
+  c->out_len += FRAME_HEADER + n;
+  return frame + FRAME_HEADER;
+}
+
+/**
+ * Send as much of the pending output as the socket takes. Returns 1
+ * once everything is sent, 0 if some is left and -1 on an error.
+ */
+int service_flush(Connection *c) {
+  while (c->out_sent < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    c->out_sent += n;
+  }
+  c->out_len = c->out_sent = 0;
+  return 1;
+}
+
+void service_close(Connection *c) {
+  close(c->fd);
+  session_close(c->session);
+  free(c->out);
+  free(c);
+}
+
+/**
+ * Watch `c` for one more event of the kind given.
+ */
+void service_rearm(Connection *c, unsigned events) {
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = c;
+  epoll_ctl(c->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/**
+ * One step of a connection, run by a worker when it is ready:
+ * finish sending what is pending, then encrypt the next chunk of
+ * plaintext and queue its frames, or at end of input queue the
+ * final log and close once it is all sent.
+ */
+void service_step(PoolTask *task, WorkPool *pool, int worker) {
+  Connection *c = (Connection *) task;
+  int flushed = service_flush(c);
+  if (flushed == 0) {
+    service_rearm(c, EPOLLOUT);
+    return;
+  }
+  if (flushed < 0 || c->eof) {
+    service_close(c);
+    return;
+  }
+
+  char in[SERVICE_CHUNK];
+  ssize_t n = recv(c->fd, in, sizeof(in), MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    service_rearm(c, EPOLLIN);
+    return;
+  }
+  if (n < 0) {
+    service_close(c);
+    return;
+  }
+  if (n == 0) {
+    session_finish(c->session);
+    c->eof = 1;
+  } else {
+    char *cipher = service_frame(c, 'C', n);
+    if (cipher == NULL) {
+      service_close(c);
+      return;
+    }
+    session_encrypt(c->session, in, cipher, n);
+  }
+  const char *log;
+  size_t logged = session_log(c->session, &log);
+  if (logged > 0) {
+    char *frame = service_frame(c, 'L', logged);
+    if (frame == NULL) {
+      service_close(c);
+      return;
+    }
+    memcpy(frame, log, logged);
+  }
+
+  flushed = service_flush(c);
+  if (flushed < 0 || (flushed > 0 && c->eof)) {
+    service_close(c);
+  } else {
+    service_rearm(c, flushed ? EPOLLIN : EPOLLOUT);
+  }
+}
+
+typedef struct {
+  PoolTask task;
+  int listener;
+  int epoll;
+} ServiceLoop;
+
+/**
+ * The epoll loop, run as a task that never finishes so that the
+ * pool keeps running: accepts new connections and pushes each
+ * connection that becomes ready onto the workers' deques in turn.
+ */
+void service_loop(PoolTask *task, WorkPool *pool, int worker) {
+  ServiceLoop *loop = (ServiceLoop *) task;
+  struct epoll_event events[SERVICE_EVENTS];
+  int next = 0;
+  while (1) {
+    int ready = epoll_wait(loop->epoll, events, SERVICE_EVENTS, -1);
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.ptr != NULL) {
+        Connection *c = events[i].data.ptr;
+        if (pool_push(pool, next++ % pool->workers, &c->task) != 0) {
+          service_close(c);
+        }
+        continue;
+      }
+      int fd;
+      while ((fd = accept(loop->listener, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        // Out of memory only refuses this connection
+        Connection *c = calloc(1, sizeof(Connection));
+        if (c == NULL || (c->session = session_open()) == NULL) {
+          close(fd);
+          free(c);
+          continue;
+        }
+        c->task.run = &service_step;
+        c->fd = fd;
+        c->epoll = loop->epoll;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = c;
+        epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &ev);
+      }
+    }
+  }
+}
+
+/**
+ * Listen on the Unix socket at `path` (replacing a stale socket,
+ * but nothing else) and serve connections until the process is
+ * killed, with `workers` threads besides the one running the epoll
+ * loop. `start` (if not NULL) is called in each thread as it
+ * starts. Returns -1 if the socket cannot be set up.
+ */
+int run_service(const char *path, int workers, void (*start)(int worker)) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      printf("`%s` exists and is not a socket.\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    return -1;
+  }
+  if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    close(listener);
+    return -1;
+  }
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) {
+    close(listener);
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &ev);
+
+  WorkPool pool;
+  pool_init(&pool, workers + 1, start);
+  ServiceLoop loop = { { &service_loop }, listener, epoll };
+  if (pool_push(&pool, 0, &loop.task) != 0) {
+    close(epoll);
+    close(listener);
+    return -1;
+  }
+  pool_run(&pool);
+  return 0;
+}
+
+#endif // ENCRYPT_SERVICE_H
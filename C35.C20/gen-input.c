@@ -0,0 +1,97 @@
+/**********************************************************
+ * Synthetic input generator for the benchmarks. Writes   *
+ * `size` bytes drawn from one of several distributions   *
+ * to standard output, reproducibly for a given seed:     *
+ *   text    printable ASCII in lines of up to 80         *
+ *   binary  uniformly random bytes                       *
+ *   runs    runs of 1 to 4096 copies of a random byte    *
+ *   skewed  letters with a steep frequency falloff       *
+ * Usage: `gen-input <text|binary|runs|skewed> <size>     *
+ *        [seed] > file` (size accepts K, M and G)        *
+ **********************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK (1 << 16)
+
+unsigned long long state;
+
+/**
+ * xorshift64*, so the output does not depend on the C library.
+ */
+unsigned long long next() {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ULL;
+}
+
+/**
+ * Parse a size such as `4096`, `64K`, `16M` or `2G`.
+ */
+long long parse_size(const char *s) {
+  char *end;
+  long long n = strtoll(s, &end, 10);
+  switch (*end) {
+  case 'G': case 'g': n <<= 10; /* fall through */
+  case 'M': case 'm': n <<= 10; /* fall through */
+  case 'K': case 'k': n <<= 10;
+  }
+  return n;
+}
+
+/**
+ * Fill `buf` with `n` bytes of the distribution `dist`. `run`
+ * and `run_byte` carry the run in progress across blocks.
+ */
+void fill(const char *dist, unsigned char *buf, int n, long long *run, int *run_byte) {
+  static const char skew[] = "etaoinshrdlcumwfgypbvkjxqz";
+  for (int i = 0; i < n; i++) {
+    unsigned long long r = next();
+    if (strcmp(dist, "binary") == 0) {
+      buf[i] = r >> 56;
+    } else if (strcmp(dist, "runs") == 0) {
+      if (*run == 0) {
+        *run = 1 + (r >> 32) % 4096;
+        *run_byte = r >> 56;
+      }
+      buf[i] = *run_byte;
+      (*run)--;
+    } else if (strcmp(dist, "skewed") == 0) {
+      // Each letter is about half as likely as the one before it
+      int rank = __builtin_ctzll(r | (1ULL << 25));
+      buf[i] = skew[rank];
+    } else {
+      buf[i] = r % 81 == 0 ? '\n' : 32 + (r >> 32) % 95;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: gen-input <text|binary|runs|skewed> <size> [seed]\n");
+    return 1;
+  }
+  const char *dist = argv[1];
+  if (strcmp(dist, "text") && strcmp(dist, "binary") && strcmp(dist, "runs") && strcmp(dist, "skewed")) {
+    fprintf(stderr, "Unknown distribution `%s`\n", dist);
+    return 1;
+  }
+  long long size = parse_size(argv[2]);
+  state = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+  state = state * 0x9E3779B97F4A7C15ULL + 1;
+
+  unsigned char buf[BLOCK];
+  long long run = 0;
+  int run_byte = 0;
+  while (size > 0) {
+    int n = size < BLOCK ? size : BLOCK;
+    fill(dist, buf, n, &run, &run_byte);
+    if (fwrite(buf, 1, n, stdout) != (size_t) n) {
+      return 1;
+    }
+    size -= n;
+  }
+  return 0;
+}
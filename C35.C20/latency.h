@@ -0,0 +1,254 @@
+/**********************************************************
+ * This header measures how long a character takes from   *
+ * being read to being written. The reader stamps one     *
+ * character in every LATENCY_EVERY with the time it was  *
+ * read and hands the stamp to the writer alongside the   *
+ * buffers, through a single-producer single-consumer     *
+ * queue keyed by stream offset. Once the writer has      *
+ * written past a stamped character it adds the time      *
+ * taken to a log-linear (HDR-style) histogram, keeping   *
+ * characters that were held while a reset drained the    *
+ * pipeline in a histogram of their own, next to the time *
+ * they were held for. The driver marks the start and end *
+ * of each drain, so characters that merely saw a reset   *
+ * requested are not counted as held. The report is       *
+ * printed with `latency_print`.                          *
+ **********************************************************/
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * Characters between stamps, and stamps in flight at most. When
+ * the queue is full the reader skips a stamp rather than wait.
+ */
+#define LATENCY_EVERY 4096
+#define LATENCY_QUEUE 4096
+
+/**
+ * Values below LATENCY_SUB nanoseconds are kept exactly; above
+ * that each power of two is split into LATENCY_SUB / 2 linear
+ * buckets, so a value is kept to within 2 / LATENCY_SUB of itself.
+ */
+#define LATENCY_SUB_BITS 6
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+
+typedef struct {
+  unsigned long long counts[64][LATENCY_SUB];
+  unsigned long long total;
+  unsigned long long min;
+  unsigned long long max;
+  double sum;
+} LatencyHist;
+
+/**
+ * A stamped character: its offset in the stream, when it was read
+ * and how long the pipeline had been held by drains by then.
+ */
+typedef struct {
+  long long offset;
+  unsigned long long ns;
+  unsigned long long drained;
+} LatencyStamp;
+
+/**
+ * The queue of stamps, pushed at `head` by the reader and popped
+ * at `tail` by the writer, and the writer's histograms: `held`
+ * has the part of each `reset` sample spent in drains. `next` is
+ * the offset of the next character the reader stamps.
+ */
+typedef struct {
+  LatencyStamp stamps[LATENCY_QUEUE];
+  _Alignas(64) atomic_llong head;
+  long long next;
+  _Alignas(64) atomic_llong tail;
+  LatencyHist steady;
+  LatencyHist reset;
+  LatencyHist held;
+} Latency;
+
+/**
+ * Set before the driver threads start to take the measurement.
+ */
+int latency_enabled;
+Latency latency;
+
+/**
+ * The drain clock: the time spent in finished drains and the start
+ * of the drain in progress (0 if none), under `latency_mutex`.
+ */
+pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long long latency_drain_ns;
+unsigned long long latency_drain_start;
+
+unsigned long long latency_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Called by the driver when a reset starts to drain the pipeline,
+ * and once the threads are resumed after it.
+ */
+void latency_drain_begin() {
+  pthread_mutex_lock(&latency_mutex);
+  latency_drain_start = latency_now();
+  pthread_mutex_unlock(&latency_mutex);
+}
+
+void latency_drain_end() {
+  pthread_mutex_lock(&latency_mutex);
+  if (latency_drain_start != 0) {
+    latency_drain_ns += latency_now() - latency_drain_start;
+    latency_drain_start = 0;
+  }
+  pthread_mutex_unlock(&latency_mutex);
+}
+
+/**
+ * The time spent draining up to `now`, counting the drain in
+ * progress so far.
+ */
+unsigned long long latency_drained(unsigned long long now) {
+  pthread_mutex_lock(&latency_mutex);
+  unsigned long long ns = latency_drain_ns;
+  if (latency_drain_start != 0 && now > latency_drain_start) {
+    ns += now - latency_drain_start;
+  }
+  pthread_mutex_unlock(&latency_mutex);
+  return ns;
+}
+
+/**
+ * Add `ns` to `h`. A value with its top bit at position `b` goes in
+ * row `b - LATENCY_SUB_BITS + 1`, in the column given by its top
+ * LATENCY_SUB_BITS bits.
+ */
+void latency_hist_add(LatencyHist *h, unsigned long long ns) {
+  int row = 0;
+  if (ns >= LATENCY_SUB) {
+    row = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS + 1;
+  }
+  h->counts[row][ns >> row]++;
+  if (h->total == 0 || ns < h->min) {
+    h->min = ns;
+  }
+  if (ns > h->max) {
+    h->max = ns;
+  }
+  h->total++;
+  h->sum += ns;
+}
+
+/**
+ * The smallest value at or above the given fraction of the values
+ * in `h`, to the precision of its bucket.
+ */
+unsigned long long latency_hist_quantile(LatencyHist *h, double q) {
+  unsigned long long rank = q * h->total, seen = 0;
+  for (int row = 0; row < 64; row++) {
+    for (int col = 0; col < LATENCY_SUB; col++) {
+      seen += h->counts[row][col];
+      if (seen > rank) {
+        unsigned long long top = ((unsigned long long) (col + 1) << row) - 1;
+        return top < h->max ? top : h->max;
+      }
+    }
+  }
+  return h->max;
+}
+
+/**
+ * Called by the reader once it has read the `n` characters from
+ * stream offset `at`: stamps the next character due, if among them.
+ */
+void latency_read(long long at, int n) {
+  if (latency.next >= at + n) {
+    return;
+  }
+  long long head = atomic_load_explicit(&latency.head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&latency.tail, memory_order_acquire) < LATENCY_QUEUE) {
+    LatencyStamp *s = &latency.stamps[head % LATENCY_QUEUE];
+    s->offset = latency.next;
+    s->ns = latency_now();
+    s->drained = latency_drained(s->ns);
+    atomic_store_explicit(&latency.head, head + 1, memory_order_release);
+  }
+  latency.next += (at + n - latency.next + LATENCY_EVERY - 1) / LATENCY_EVERY * LATENCY_EVERY;
+}
+
+/**
+ * Called by the writer once every character before stream offset
+ * `end` is written: records the latency of the stamps among them,
+ * as held up by a reset if the pipeline was draining for any of the
+ * time in between.
+ */
+void latency_written(long long end) {
+  long long tail = atomic_load_explicit(&latency.tail, memory_order_relaxed);
+  long long head = atomic_load_explicit(&latency.head, memory_order_acquire);
+  if (tail == head || latency.stamps[tail % LATENCY_QUEUE].offset >= end) {
+    return;
+  }
+  unsigned long long now = latency_now();
+  unsigned long long drained = latency_drained(now);
+  for (; tail < head && latency.stamps[tail % LATENCY_QUEUE].offset < end; tail++) {
+    LatencyStamp *s = &latency.stamps[tail % LATENCY_QUEUE];
+    if (drained == s->drained) {
+      latency_hist_add(&latency.steady, now - s->ns);
+    } else {
+      latency_hist_add(&latency.reset, now - s->ns);
+      latency_hist_add(&latency.held, drained - s->drained);
+    }
+  }
+  atomic_store_explicit(&latency.tail, tail, memory_order_release);
+}
+
+void latency_print_hist(FILE *out, const char *name, LatencyHist *h) {
+  if (h->total == 0) {
+    fprintf(out, "%-10s %10d\n", name, 0);
+    return;
+  }
+  double q[] = { 0.5, 0.9, 0.99, 0.999 };
+  fprintf(out, "%-10s %10llu %10.1f %10.1f", name, h->total, h->min / 1e3, h->sum / h->total / 1e3);
+  for (int i = 0; i < 4; i++) {
+    fprintf(out, " %10.1f", latency_hist_quantile(h, q[i]) / 1e3);
+  }
+  fprintf(out, " %10.1f\n", h->max / 1e3);
+}
+
+/**
+ * Print the read-to-write latency in microseconds of the stamped
+ * characters, apart for those held up by a reset and overall, and
+ * how long those were held.
+ */
+void latency_print(FILE *out) {
+  LatencyHist all = latency.steady;
+  LatencyHist *r = &latency.reset;
+  for (int row = 0; row < 64; row++) {
+    for (int col = 0; col < LATENCY_SUB; col++) {
+      all.counts[row][col] += r->counts[row][col];
+    }
+  }
+  if (r->total > 0 && (all.total == 0 || r->min < all.min)) {
+    all.min = r->min;
+  }
+  all.max = r->max > all.max ? r->max : all.max;
+  all.total += r->total;
+  all.sum += r->sum;
+
+  fprintf(out, "Read to write latency (us), one character in %d:\n", LATENCY_EVERY);
+  fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "chars", "samples", "min",
+          "mean", "p50", "p90", "p99", "p99.9", "max");
+  latency_print_hist(out, "steady", &latency.steady);
+  latency_print_hist(out, "reset", &latency.reset);
+  latency_print_hist(out, "all", &all);
+  latency_print_hist(out, "held", &latency.held);
+  fflush(out);
+}
+
+#endif // LATENCY_H
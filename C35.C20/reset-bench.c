@@ -0,0 +1,293 @@
+/**********************************************************
+ * Reset-storm benchmark for the ResetController. Runs    *
+ * the five stages of the driver over the real circular   *
+ * buffers and reset controller, with stand-in counters   *
+ * instead of the encrypt module, and resets every `-f`   *
+ * characters. Each stage can be slowed down by a number  *
+ * of spins per character (`-s`) to skew the input and    *
+ * output counts apart. The same run is made first with   *
+ * no resets, and the report gives the reset pause        *
+ * (request to finish) distribution and the time lost per *
+ * reset compared to the run without resets.              *
+ * Usage: `reset-bench [-n chars] [-f every] [-b in:out]  *
+ *        [-s reader,incount,encrypt,outcount,writer]     *
+ *        [-w policy]`                                    *
+ **********************************************************/
+#include <time.h>
+#include <getopt.h>
+#include "circular-buffer.h"
+#include "reset-controller.h"
+
+#define STAGE_SPAN 4096
+
+CircularBuffer *input_buffer;
+CircularBuffer *output_buffer;
+ResetController *rc;
+
+/**
+ * Run settings: characters to move, characters between resets
+ * (0 for none), buffer sizes and spins per character per stage.
+ */
+long long total = 1 << 22;
+int every = 200;
+int input_size = 4096, output_size = 4096;
+int spins[5];
+
+/**
+ * Stand-ins for the encrypt module's counts, which the reset
+ * controller reads while draining.
+ */
+long long input_count, output_count, reset_base;
+_Atomic long long chars_read;
+sem_t reads_posted, reset_done;
+
+/**
+ * Reset pauses in nanoseconds, one per reset.
+ */
+double *pauses;
+int resets;
+
+long long get_input_total_count() {
+  return input_count;
+}
+
+long long get_output_total_count() {
+  return output_count;
+}
+
+int get_read_total_count() {
+  long long r = chars_read - reset_base;
+  return r < every ? r : every;
+}
+
+double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Spend `spins[stage]` pause instructions per character on `n`
+ * characters, standing in for the stage's work.
+ */
+void work(int stage, int n) {
+  for (long i = 0; i < (long) spins[stage] * n; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+  }
+}
+
+/**
+ * Resets once `every` characters have been read since the last
+ * one, like the module's reset thread, timing each reset from
+ * the start of the drain until the stages are resumed.
+ */
+void *reset_thread() {
+  while (1) {
+    sem_wait(&reads_posted);
+    if (chars_read - reset_base < every) {
+      if (chars_read >= total) {
+        return 0;
+      }
+      continue;
+    }
+
+    double start = seconds();
+    pthread_mutex_lock(rc->reset_mutex);
+    rc_drain(rc);
+    input_count = 0;
+    output_count = 0;
+    rc_clear(rc);
+    pthread_cond_broadcast(rc->reset_cond);
+    pthread_mutex_unlock(rc->reset_mutex);
+    pauses[resets++] = (seconds() - start) * 1e9;
+
+    reset_base += every;
+    sem_post(&reset_done);
+  }
+}
+
+/**
+ * Reads blocks capped at the next reset point, waiting for that
+ * reset to finish before crossing it.
+ */
+void *reader() {
+  char span[STAGE_SPAN];
+  memset(span, 'a', sizeof(span));
+  while (1) {
+    if (thread_block(rc, 0)) {
+      continue;
+    }
+    long long read = chars_read;
+    if (every > 0 && read > 0 && read % every == 0) {
+      sem_wait(&reset_done);
+    }
+    int n = total - read < STAGE_SPAN ? total - read : STAGE_SPAN;
+    if (every > 0 && n > every - read % every) {
+      n = every - read % every;
+    }
+    if (n == 0) {
+      cb_close(input_buffer);
+      sem_post(&reads_posted);
+      return 0;
+    }
+    work(0, n);
+    chars_read += n;
+    sem_post(&reads_posted);
+    cb_put_n(input_buffer, span, n);
+  }
+}
+
+/**
+ * The input counter, encryptor and output counter: take a span,
+ * then process as much of it as the reset controller allows.
+ */
+void *middle_stage(void *arg) {
+  int thread = *(int *) arg;
+  CircularBuffer *from = thread == 3 ? output_buffer : input_buffer;
+  int cid = thread == 2 ? 1 : 0;
+  char span[STAGE_SPAN];
+  int n = 0, done = 0;
+  while (1) {
+    if (thread_block(rc, thread)) {
+      continue;
+    }
+    if (done == n) {
+      n = cb_get_n(from, cid, span, STAGE_SPAN);
+      done = 0;
+      if (n == 0) {
+        if (thread == 2) {
+          cb_close(output_buffer);
+        }
+        return 0;
+      }
+    }
+    int k = rc_span_begin(rc, thread, n - done);
+    work(thread, k);
+    if (thread == 1) {
+      input_count += k;
+    } else if (thread == 3) {
+      output_count += k;
+    }
+    rc_span_end(rc, thread);
+    if (thread == 2) {
+      cb_put_n(output_buffer, span + done, k);
+    }
+    done += k;
+  }
+}
+
+void *writer() {
+  char span[STAGE_SPAN];
+  while (1) {
+    if (thread_block(rc, 4)) {
+      continue;
+    }
+    int n = cb_get_n(output_buffer, 1, span, STAGE_SPAN);
+    if (n == 0) {
+      return 0;
+    }
+    work(4, n);
+  }
+}
+
+/**
+ * Move `total` characters through the five stages, resetting
+ * every `every` characters (never if 0), and return the time taken.
+ */
+double run() {
+  input_buffer = aligned_alloc(_Alignof(CircularBuffer), sizeof(CircularBuffer));
+  output_buffer = aligned_alloc(_Alignof(CircularBuffer), sizeof(CircularBuffer));
+  cb_init(input_buffer, input_size, 2);
+  cb_init(output_buffer, output_size, 2);
+  rc = aligned_alloc(_Alignof(ResetController), sizeof(ResetController));
+  rc_init(rc);
+  rc->verbose = 0;
+  input_count = output_count = reset_base = 0;
+  chars_read = 0;
+  resets = 0;
+  sem_init(&reads_posted, 0, 0);
+  sem_init(&reset_done, 0, 0);
+
+  double start = seconds();
+  pthread_t threads[6];
+  int ids[5] = { 0, 1, 2, 3, 4 };
+  if (every > 0) {
+    pthread_create(&threads[5], NULL, &reset_thread, NULL);
+  }
+  pthread_create(&threads[0], NULL, &reader, NULL);
+  for (int t = 1; t <= 3; t++) {
+    pthread_create(&threads[t], NULL, &middle_stage, &ids[t]);
+  }
+  pthread_create(&threads[4], NULL, &writer, NULL);
+  for (int t = 0; t < 5; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  double elapsed = seconds() - start;
+  if (every > 0) {
+    sem_post(&reads_posted);
+    pthread_join(threads[5], NULL);
+  }
+
+  cb_destroy(input_buffer);
+  cb_destroy(output_buffer);
+  free(input_buffer);
+  free(output_buffer);
+  return elapsed;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:b:s:w:")) != -1) {
+    switch (opt) {
+    case 'n':
+      total = atoll(optarg);
+      break;
+    case 'f':
+      every = atoi(optarg);
+      break;
+    case 'b':
+      sscanf(optarg, "%d:%d", &input_size, &output_size);
+      break;
+    case 's':
+      sscanf(optarg, "%d,%d,%d,%d,%d", &spins[0], &spins[1], &spins[2], &spins[3], &spins[4]);
+      break;
+    case 'w':
+      if (wait_policy_select(optarg) != 0) {
+        printf("Unknown wait policy `%s`\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      printf("Usage: reset-bench [-n chars] [-f every] [-b in:out] [-s r,i,e,o,w] [-w policy]\n");
+      return 1;
+    }
+  }
+
+  int reset_every = every;
+  pauses = malloc((reset_every > 0 ? total / reset_every + 1 : 1) * sizeof(double));
+  every = 0;
+  double base = run();
+  every = reset_every;
+  double with = every > 0 ? run() : base;
+
+  printf("chars=%lld every=%d buffers=%d:%d spins=%d,%d,%d,%d,%d policy=%s\n", total, every,
+         input_size, output_size, spins[0], spins[1], spins[2], spins[3], spins[4], wait_policy->name);
+  printf("no_resets_s=%.4f with_resets_s=%.4f resets=%d\n", base, with, resets);
+  if (resets > 0) {
+    qsort(pauses, resets, sizeof(double), cmp_double);
+    printf("pause_us p50=%.2f p99=%.2f max=%.2f\n", pauses[resets / 2] / 1e3,
+           pauses[(int) (resets * 0.99)] / 1e3, pauses[resets - 1] / 1e3);
+    printf("lost_us_per_reset=%.2f MBps_no_resets=%.2f MBps_with_resets=%.2f\n",
+           (with - base) / resets * 1e6, total / base / 1e6, total / with / 1e6);
+  }
+  return 0;
+}
@@ -1,9 +1,21 @@
 /**********************************************************
- * This file provides a struct and a helper function used *
- * for thread synchronization and module reset handling.  *
- * It uses various synchronization mechanisms including a *
- * mutex, two condition variables, and five semaphores to *
- * coordinate between the threads.                        *
+ * This file provides the ResetController, which holds    *
+ * the driver threads for a module reset until the input  *
+ * and output counts agree. It has a mutex, an atomic     *
+ * reset flag, a per-thread `active` flag for spans, and  *
+ * five process-private semaphores that let single        *
+ * threads through. The drain: `rc_drain` sets the reset  *
+ * flag and waits on `reset_idle` until no thread is      *
+ * inside a span. It then takes the characters read as    *
+ * the `target` and posts the semaphores of the lagging   *
+ * side. A thread let through by `thread_block` moves one *
+ * character and posts the next, bumping `generation` to  *
+ * wake the others. The one that finds both counts at the *
+ * target signals `reset_ready`. `rc_clear` ends the      *
+ * reset and wakes the threads parked on `reset_cond`.    *
+ * Waits follow the policy in `wait-policy.h`. Building   *
+ * with `-DRC_ALWAYS_LOCK` disables the atomic fast       *
+ * paths, for A/B comparison.                             *
  **********************************************************/
 
 #include <stdlib.h>
@@ -12,21 +24,53 @@
 #include <semaphore.h>
 #include <fcntl.h>
 #include "encrypt-module.h"
+#include "wait-policy.h"
+
+/**
+ * Whether one thread is processing a span, on a cache line of its
+ * own so that bracketing a span never writes to a line that other
+ * threads touch.
+ */
+typedef struct {
+  _Alignas(64) atomic_int busy;
+} RCActive;
 
 /**
  * ResetController contains a mutex for thread-safe access and
- * a flag for a reset in progress. It also provides two  
- * condition variables to coordinate when the reset is   
- * ready and when it's completed. Finally, it includes 5 
- * semaphores to allow controlled processing of specific 
- * threads so they can be synced before a reset.         
+ * a flag for a reset in progress. Its condition variables signal
+ * when the threads are out of their spans (`reset_idle`), when
+ * the counts have reached the target (`reset_ready`) and when a
+ * waiting thread should look again (`reset_cond`). Its five
+ * semaphores let specific threads through one character at a
+ * time so the counts can be synced before a reset.
+ * `active` marks the threads currently processing a span, so a
+ * reset can wait for them to go idle before it compares the
+ * input and output counts, and `permitted` records which
+ * threads were let through by one of those semaphores.
+ * `generation` is bumped whenever a waiting thread should look
+ * again, i.e. when semaphores are posted or a reset finishes,
+ * and `target` is the number of characters read before the
+ * reset, which both counts must reach before it can go ahead.
+ * `verbose` makes `rc_drain` report its progress.
+ * `reset_in_progress` and `active` are atomic so the threads can
+ * check for a reset and bracket a span without the mutex when no
+ * reset is pending. `reset_in_progress` is only changed with the
+ * mutex held; each `active` flag only by its own thread.
+ * Allocate with `aligned_alloc` to keep the flags apart.
  */
 typedef struct {
-  int reset_in_progress;
+  atomic_int reset_in_progress;
+  int verbose;
+  int target;
+  RCActive active[5];
+  int permitted[5];
+  unsigned generation;
+  WaitState wait[5];
 
   pthread_mutex_t *reset_mutex;
   pthread_cond_t *reset_cond;
   pthread_cond_t *reset_ready;
+  pthread_cond_t *reset_idle;
 
   sem_t *sem_thread_lock[5];
 } ResetController;
@@ -35,7 +79,15 @@ typedef struct {
  * Initializes the ResetController at the given pointer.
  */
 void rc_init(ResetController *rc) {
-  rc->reset_in_progress = 0;
+  atomic_init(&rc->reset_in_progress, 0);
+  rc->verbose = 1;
+  rc->target = 0;
+  rc->generation = 0;
+  for (int t = 0; t < 5; t++) {
+    atomic_init(&rc->active[t].busy, 0);
+    rc->permitted[t] = 0;
+    ws_init(&rc->wait[t]);
+  }
 
   rc->reset_mutex = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
   pthread_mutex_init(rc->reset_mutex, NULL);
@@ -43,25 +95,80 @@ void rc_init(ResetController *rc) {
   pthread_cond_init(rc->reset_cond, NULL);
   rc->reset_ready = (pthread_cond_t*) malloc(sizeof(pthread_cond_t));
   pthread_cond_init(rc->reset_ready, NULL);
+  rc->reset_idle = (pthread_cond_t*) malloc(sizeof(pthread_cond_t));
+  pthread_cond_init(rc->reset_idle, NULL);
+
+  // Unnamed, process-private semaphores so concurrent processes cannot share them
+  for (int t = 0; t < 5; t++) {
+    rc->sem_thread_lock[t] = (sem_t*) malloc(sizeof(sem_t));
+    sem_init(rc->sem_thread_lock[t], 0, 0);
+  }
+}
+
+/**
+ * Let every thread but the reader take one more step, for when
+ * both counts are level but short of the reset's target.
+ */
+void rc_post_all(ResetController *rc) {
+  for (int t = 1; t < 5; t++) {
+    sem_post(rc->sem_thread_lock[t]);
+  }
+}
+
+/**
+ * Wake the threads waiting in `rc_wait` after posting to one or
+ * more of the semaphores, so they can try them again.
+ * Must be called with `reset_mutex` held.
+ */
+void rc_wake(ResetController *rc) {
+  rc->generation++;
+  pthread_cond_broadcast(rc->reset_cond);
+}
+
+/**
+ * Wait for the reset in progress to finish or for new posts to
+ * the semaphores. Following the wait policy, `thread` first spins
+ * or yields with `reset_mutex` released and then parks on
+ * `reset_cond`.
+ * Must be called with `reset_mutex` held; returns with it held.
+ */
+void rc_wait(ResetController *rc, int thread) {
+  WaitState *ws = &rc->wait[thread];
+  unsigned seen = rc->generation;
+  while (rc->generation == seen) {
+    if (ws->round >= ws->budget + wait_policy->yields) {
+      ws->round++;
+      pthread_cond_wait(rc->reset_cond, rc->reset_mutex);
+      break;
+    }
+    pthread_mutex_unlock(rc->reset_mutex);
+    ws_step(ws);
+    pthread_mutex_lock(rc->reset_mutex);
+  }
+  ws_done(ws);
+}
 
-  rc->sem_thread_lock[0] = sem_open("/sem_read_lock", O_CREAT, 0644, 0);
-  sem_unlink("/sem_read_lock");
-  rc->sem_thread_lock[1] = sem_open("/sem_icount_lock", O_CREAT, 0644, 0);
-  sem_unlink("/sem_icount_lock");
-  rc->sem_thread_lock[2] = sem_open("/sem_encrypt_lock", O_CREAT, 0644, 0);
-  sem_unlink("/sem_encrypt_lock");
-  rc->sem_thread_lock[3] = sem_open("/sem_ocount_lock", O_CREAT, 0644, 0);
-  sem_unlink("/sem_ocount_lock");
-  rc->sem_thread_lock[4] = sem_open("/sem_write_lock", O_CREAT, 0644, 0);
-  sem_unlink("/sem_write_lock");
+/**
+ * Whether a reset may be in progress, as a single relaxed load,
+ * for callers that want to skip work on the common path.
+ */
+int rc_pending(ResetController *rc) {
+  return atomic_load_explicit(&rc->reset_in_progress, memory_order_relaxed);
 }
 
 /**
  * Determines if the thread represented by `int thread`
  * is allowed to perform its operation. Returns 0 if
  * the thread is able to proceed or 1 if it is blocked.
+ * When no reset is pending this is a single relaxed load; a
+ * reset that is missed here is caught by `rc_span_begin`.
  */ 
 int thread_block(ResetController *rc, int thread) {
+#ifndef RC_ALWAYS_LOCK
+  if (!rc_pending(rc)) {
+    return 0;
+  }
+#endif
   /* Lock `rc->reset_mutex` for safe concurrency */
   pthread_mutex_lock(rc->reset_mutex);
   /* If a reset is not in progress, allow the thread to continue */
@@ -73,12 +180,12 @@ int thread_block(ResetController *rc, int thread) {
   int s = sem_trywait(rc->sem_thread_lock[thread]);
   if (!s) {
     // printf("| Thread %d: ", thread);
-    int i = get_input_total_count();
-    int o = get_output_total_count();
+    long long i = get_input_total_count();
+    long long o = get_output_total_count();
     // printf("Inputs = %d / Outputs = %d\n", i, o);
-    if (i == o) {
+    if (i == o && i == rc->target) {
       pthread_cond_signal(rc->reset_ready);
-      pthread_cond_wait(rc->reset_cond, rc->reset_mutex);
+      rc_wait(rc, thread);
       pthread_mutex_unlock(rc->reset_mutex);
       return 1;
     }
@@ -91,22 +198,142 @@ int thread_block(ResetController *rc, int thread) {
       sem_post(rc->sem_thread_lock[3]);
       sem_post(rc->sem_thread_lock[4]);
     }
+    if (i == o) {
+      rc_post_all(rc);
+    }
+    rc_wake(rc);
+    rc->permitted[thread] = 1;
     pthread_mutex_unlock(rc->reset_mutex);
     return 0;
   }
 
   if (rc->reset_in_progress) {
-    pthread_cond_wait(rc->reset_cond, rc->reset_mutex);
+    rc_wait(rc, thread);
   }
 
   pthread_mutex_unlock(rc->reset_mutex);
   return 1;
 }
 
+/**
+ * Whether any thread is processing a span.
+ */
+int rc_busy(ResetController *rc) {
+  for (int t = 0; t < 5; t++) {
+    if (atomic_load(&rc->active[t].busy)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Stop the driver threads for a reset and let the lagging ones
+ * through one character at a time until the input and output
+ * counts both reach the number of characters read.
+ * Waits for any span in progress to be finished, then compares
+ * the total input and output counts with each other and with
+ * the number of characters read, and resumes the side that is
+ * behind (or both, if they are level but short of the characters
+ * read). Waits for one of those threads to signal `reset_ready`
+ * once both counts have got there.
+ * Must be called with `reset_mutex` held; returns with it held
+ * and `reset_in_progress` still set, until `rc_clear`.
+ */
+void rc_drain(ResetController *rc) {
+  rc->reset_in_progress = 1;
+  while (rc_busy(rc)) {
+    pthread_cond_wait(rc->reset_idle, rc->reset_mutex);
+  }
+
+  long long inputs = get_input_total_count();
+  long long outputs = get_output_total_count();
+  rc->target = get_read_total_count();
+
+  if (rc->verbose) {
+    printf("| Inputs: %lld / Outputs: %lld / Read: %d\n", inputs, outputs, rc->target);
+  }
+  if (inputs < outputs) {
+    sem_post(rc->sem_thread_lock[1]);
+    sem_post(rc->sem_thread_lock[2]);
+  }
+  if (inputs > outputs) {
+    sem_post(rc->sem_thread_lock[2]);
+    sem_post(rc->sem_thread_lock[3]);
+    sem_post(rc->sem_thread_lock[4]);
+  }
+  if (inputs == outputs && inputs != rc->target) {
+    rc_post_all(rc);
+  }
+  rc_wake(rc);
+
+  if ((inputs != outputs || inputs != rc->target) && rc->verbose) {
+    printf("Waiting for input and output to synchronize...\n");
+  }
+  // Re-check after every wakeup, which may be spurious
+  while (get_input_total_count() != rc->target || get_output_total_count() != rc->target) {
+    pthread_cond_wait(rc->reset_ready, rc->reset_mutex);
+  }
+}
+
+/**
+ * Marks `thread` as processing a span of `max` items it has
+ * already taken from a buffer and returns how many of them it
+ * may process now: all of them normally, a single item while a
+ * reset is in progress if `thread_block` let it through, or none
+ * if the reset started after it last checked.
+ * Must be paired with `rc_span_end`.
+ * The fast path sets the thread's own `active` flag before
+ * checking for a reset, while `rc_drain` sets the reset flag
+ * before reading the `active` flags (both sequentially
+ * consistent), so either the reset sees this span and waits for
+ * it, or the span sees the reset. No shared line is written.
+ */
+int rc_span_begin(ResetController *rc, int thread, int max) {
+#ifndef RC_ALWAYS_LOCK
+  atomic_store(&rc->active[thread].busy, 1);
+  if (!atomic_load(&rc->reset_in_progress)) {
+    return max;
+  }
+  pthread_mutex_lock(rc->reset_mutex);
+#else
+  pthread_mutex_lock(rc->reset_mutex);
+  atomic_store(&rc->active[thread].busy, 1);
+#endif
+  int span = max;
+  if (rc->reset_in_progress) {
+    span = rc->permitted[thread] ? 1 : 0;
+    rc->permitted[thread] = 0;
+  }
+  pthread_mutex_unlock(rc->reset_mutex);
+  return span;
+}
+
+/**
+ * Marks the end of the span `thread` started with
+ * `rc_span_begin`, waking a pending reset so it can check
+ * whether every thread is idle.
+ */
+void rc_span_end(ResetController *rc, int thread) {
+#ifndef RC_ALWAYS_LOCK
+  atomic_store(&rc->active[thread].busy, 0);
+  if (atomic_load(&rc->reset_in_progress)) {
+    pthread_mutex_lock(rc->reset_mutex);
+    pthread_cond_signal(rc->reset_idle);
+    pthread_mutex_unlock(rc->reset_mutex);
+  }
+#else
+  pthread_mutex_lock(rc->reset_mutex);
+  atomic_store(&rc->active[thread].busy, 0);
+  pthread_cond_signal(rc->reset_idle);
+  pthread_mutex_unlock(rc->reset_mutex);
+#endif
+}
+
 /**
  * Clear the state of the ResetController by setting
- * the `reset_in_progress` flag to 0 and consuming 
- * all of the semaphores.
+ * the `reset_in_progress` flag to 0, starting a new
+ * generation and consuming all of the semaphores.
  * Does not acquire a lock on `reset_mutex`, so should
  * be called from a scope that already owns the lock.
  */ 
@@ -114,6 +341,10 @@ int rc_clear(ResetController *rc) {
 //   pthread_mutex_lock(rc->reset_mutex);
 
   rc->reset_in_progress = 0;
+  rc->generation++;
+  for (int t = 0; t < 5; t++) {
+    rc->permitted[t] = 0;
+  }
 
   while (!sem_trywait(rc->sem_thread_lock[0])) {}
   while (!sem_trywait(rc->sem_thread_lock[1])) {}
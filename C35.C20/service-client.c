@@ -0,0 +1,238 @@
+/**********************************************************
+ * Load generator for the encryption service (`encrypt -S *
+ * <socket>`). Each of `-c` threads sends requests of     *
+ * `-b` bytes of text one after another, each on a new    *
+ * connection, until `-n` requests have been made. Every  *
+ * answer's ciphertext and log are compared byte for byte *
+ * with a local Session on the same text, logging in the  *
+ * format given with `-L` (the service's own `-L`).       *
+ * Prints the requests per second, throughput and the     *
+ * latency distribution from connect to the last frame.   *
+ * Usage: `service-client -s socket [-c threads]          *
+ *        [-n requests] [-b bytes] [-L format]`           *
+ **********************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#define encrypt encrypt_unistd
+#include <unistd.h>
+#undef encrypt
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "encrypt-module.h"
+
+const char *path;
+int threads = 4;
+int requests = 1000;
+int bytes = 4096;
+
+atomic_int issued;
+atomic_int errors;
+double *latencies;
+atomic_int completed;
+
+/**
+ * The plaintext sent with every request, and the ciphertext and log
+ * the service must answer with.
+ */
+char *plain;
+char *expected;
+char *expected_log;
+size_t expected_log_size;
+
+/**
+ * The reset callbacks the module declares; no module thread runs
+ * here, so they are never called.
+ */
+void reset_requested() {
+}
+
+void reset_finished() {
+}
+
+double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Make one request and check the answer. The service answers as it
+ * reads, so the plaintext is sent and the answer received in one
+ * poll loop, and the frames are parsed once the service closes.
+ * Returns 0 if the answer is right.
+ */
+int request(char *cipher, char *log, char **answer, size_t *answer_cap) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  int sent = 0;
+  size_t received = 0;
+  if (bytes == 0) {
+    shutdown(fd, SHUT_WR);
+  }
+  while (1) {
+    struct pollfd pfd = { fd, sent < bytes ? POLLIN | POLLOUT : POLLIN, 0 };
+    if (poll(&pfd, 1, -1) < 0) {
+      break;
+    }
+    if (sent < bytes && (pfd.revents & POLLOUT)) {
+      ssize_t k = send(fd, plain + sent, bytes - sent, MSG_NOSIGNAL);
+      if (k > 0 && (sent += k) == bytes) {
+        shutdown(fd, SHUT_WR);
+      }
+    }
+    if (received == *answer_cap) {
+      *answer_cap = *answer_cap ? *answer_cap * 2 : 65536;
+      *answer = realloc(*answer, *answer_cap);
+    }
+    ssize_t k = recv(fd, *answer + received, *answer_cap - received, 0);
+    if (k == 0 || (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      break;
+    }
+    received += k > 0 ? k : 0;
+  }
+  close(fd);
+
+  int got = 0;
+  size_t logged = 0;
+  size_t at = 0;
+  while (at + 5 <= received) {
+    unsigned char *header = (unsigned char *) *answer + at;
+    size_t n = header[1] | header[2] << 8 | header[3] << 16 | (size_t) header[4] << 24;
+    char *payload = *answer + at + 5;
+    if (at + 5 + n > received) {
+      break;
+    }
+    if (header[0] == 'C' && got + n <= (size_t) bytes) {
+      memcpy(cipher + got, payload, n);
+      got += n;
+    } else if (header[0] == 'L' && logged + n <= expected_log_size) {
+      memcpy(log + logged, payload, n);
+      logged += n;
+    } else {
+      break;
+    }
+    at += 5 + n;
+  }
+  return sent == bytes && at == received && got == bytes && memcmp(cipher, expected, bytes) == 0 &&
+                 logged == expected_log_size && memcmp(log, expected_log, logged) == 0
+             ? 0
+             : -1;
+}
+
+void *client(void *arg) {
+  char *cipher = malloc(bytes + 1);
+  char *log = malloc(expected_log_size + 1);
+  char *answer = NULL;
+  size_t answer_cap = 0;
+  while (atomic_fetch_add(&issued, 1) < requests) {
+    double start = seconds();
+    if (request(cipher, log, &answer, &answer_cap) != 0) {
+      atomic_fetch_add(&errors, 1);
+      continue;
+    }
+    latencies[atomic_fetch_add(&completed, 1)] = (seconds() - start) * 1e6;
+  }
+  free(cipher);
+  free(log);
+  free(answer);
+  return 0;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c:n:b:L:")) != -1) {
+    switch (opt) {
+    case 's':
+      path = optarg;
+      break;
+    case 'c':
+      threads = atoi(optarg);
+      break;
+    case 'n':
+      requests = atoi(optarg);
+      break;
+    case 'b':
+      bytes = atoi(optarg);
+      break;
+    case 'L':
+      if (set_log_format(optarg) != 0) {
+        fprintf(stderr, "Unknown log format `%s`. Choose text, sparse or binary.\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      path = NULL;
+      break;
+    }
+  }
+  if (path == NULL || threads < 1 || requests < 1 || bytes < 0) {
+    fprintf(stderr, "Usage: service-client -s socket [-c threads] [-n requests] [-b bytes] "
+                    "[-L format]\n");
+    return 1;
+  }
+
+  plain = malloc(bytes + 1);
+  expected = malloc(bytes + 1);
+  srand(1);
+  for (int i = 0; i < bytes; i++) {
+    plain[i] = (i + 1) % 81 == 0 ? '\n' : ' ' + rand() % 95;
+  }
+  Session *session = session_open();
+  if (session == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  session_encrypt(session, plain, expected, bytes);
+  session_finish(session);
+  const char *log;
+  expected_log_size = session_log(session, &log);
+  expected_log = malloc(expected_log_size + 1);
+  memcpy(expected_log, log, expected_log_size);
+  session_close(session);
+  latencies = malloc(requests * sizeof(double));
+
+  double start = seconds();
+  pthread_t *ids = malloc(threads * sizeof(pthread_t));
+  for (int t = 0; t < threads; t++) {
+    pthread_create(&ids[t], NULL, &client, NULL);
+  }
+  for (int t = 0; t < threads; t++) {
+    pthread_join(ids[t], NULL);
+  }
+  double elapsed = seconds() - start;
+
+  int n = atomic_load(&completed);
+  printf("requests=%d errors=%d threads=%d bytes=%d wall_s=%.3f req_per_s=%.1f MBps=%.2f\n", n,
+         atomic_load(&errors), threads, bytes, elapsed, n / elapsed, (double) n * bytes / elapsed / 1e6);
+  if (n > 0) {
+    qsort(latencies, n, sizeof(double), cmp_double);
+    printf("latency_us p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n", latencies[n / 2],
+           latencies[(int) (n * 0.9)], latencies[(int) (n * 0.99)], latencies[(int) (n * 0.999)],
+           latencies[n - 1]);
+  }
+  return atomic_load(&errors) > 0;
+}
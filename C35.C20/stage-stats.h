@@ -0,0 +1,309 @@
+/**********************************************************
+ * This header defines the runtime statistics kept by the *
+ * driver threads: characters processed, time spent in    *
+ * buffer calls and blocked on a reset, and a sampled     *
+ * histogram of how full the buffer a thread fills was.   *
+ * Each thread owns one cache-line aligned StageStats, so *
+ * updating it never touches another thread's line. The  *
+ * stats are printed with `stats_print`, at exit and on   *
+ * SIGUSR1 by a thread that waits for the signal.         *
+ * With `stats_perf` set, each thread also opens hardware *
+ * counters for itself with `perf_event_open`; counters   *
+ * the system does not offer are left out of the report. *
+ **********************************************************/
+#ifndef STAGE_STATS_H
+#define STAGE_STATS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __linux__
+#define encrypt encrypt_unistd
+#include <unistd.h>
+#undef encrypt
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#else
+// No perf_event_open, so every counter reads as unavailable
+#define PERF_TYPE_HARDWARE 0
+#define PERF_TYPE_SOFTWARE 0
+#define PERF_COUNT_HW_CPU_CYCLES 0
+#define PERF_COUNT_HW_INSTRUCTIONS 0
+#define PERF_COUNT_HW_CACHE_MISSES 0
+#define PERF_COUNT_HW_BRANCH_MISSES 0
+#define PERF_COUNT_SW_CONTEXT_SWITCHES 0
+#endif
+
+#define STATS_MAX 64
+#define OCCUPANCY_BUCKETS 10
+
+/**
+ * Sample the occupancy of the buffer a thread fills on every
+ * OCCUPANCY_SAMPLE-th put.
+ */
+#define OCCUPANCY_SAMPLE 16
+
+/**
+ * The counters opened per thread in profiling mode.
+ */
+typedef struct {
+  const char *name;
+  unsigned type;
+  unsigned long long config;
+} PerfEvent;
+
+PerfEvent perf_events[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+#define PERF_EVENTS (sizeof(perf_events) / sizeof(perf_events[0]))
+
+/**
+ * Set before the driver threads start to open the counters.
+ */
+int stats_perf;
+
+/**
+ * Statistics for one thread. `buffer_ns` is the time spent in
+ * `cb_get_n`/`cb_put_n` (waiting for data or room, plus the
+ * copy), `reset_ns` the time spent in `thread_block` while a
+ * reset was in progress, and `occupancy` counts samples of the
+ * filled buffer by tenths of its size. `perf_fd` holds the
+ * thread's counters in profiling mode, -1 where unavailable.
+ */
+typedef struct {
+  _Alignas(64) const char *name;
+  int index;
+  unsigned long long chars;
+  unsigned long long spans;
+  unsigned long long buffer_ns;
+  unsigned long long reset_ns;
+  unsigned long long puts;
+  unsigned long long occupancy[OCCUPANCY_BUCKETS];
+  int perf_fd[PERF_EVENTS];
+} StageStats;
+
+StageStats stage_stats[STATS_MAX];
+atomic_int stats_count;
+double stats_start;
+
+unsigned long long stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Open the profiling counters for the calling thread, counting
+ * hardware events in user space only (which is all an unprivileged
+ * process may count). Any the kernel refuses are left at -1.
+ */
+void stats_perf_open(StageStats *st) {
+  for (unsigned e = 0; e < PERF_EVENTS; e++) {
+    st->perf_fd[e] = -1;
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[e].type;
+    attr.config = perf_events[e].config;
+    // Context switches happen in the kernel, so only hardware
+    // events are limited to user space
+    attr.exclude_kernel = perf_events[e].type == PERF_TYPE_HARDWARE;
+    attr.exclude_hv = 1;
+    st->perf_fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+}
+
+/**
+ * Read counter `e` of `st` into `value`. Returns 0 on success or
+ * -1 if the counter is not available.
+ */
+int stats_perf_read(StageStats *st, unsigned e, unsigned long long *value) {
+#ifdef __linux__
+  if (st->perf_fd[e] >= 0 && read(st->perf_fd[e], value, sizeof(*value)) == sizeof(*value)) {
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+/**
+ * Claim the StageStats for a new thread called `name`; `index`
+ * tells apart threads with the same name. Threads beyond
+ * STATS_MAX share the last entry. Must be called from the thread
+ * itself, so that profiling counters count that thread.
+ */
+StageStats *stats_register(const char *name, int index) {
+  int i = atomic_fetch_add(&stats_count, 1);
+  if (i >= STATS_MAX) {
+    return &stage_stats[STATS_MAX - 1];
+  }
+  StageStats *st = &stage_stats[i];
+  st->name = name;
+  st->index = index;
+  if (stats_perf) {
+    stats_perf_open(st);
+  } else {
+    for (unsigned e = 0; e < PERF_EVENTS; e++) {
+      st->perf_fd[e] = -1;
+    }
+  }
+  return st;
+}
+
+/**
+ * Count a put of a buffer that now holds `count` of `size` items,
+ * sampling its occupancy every OCCUPANCY_SAMPLE puts.
+ */
+void stats_occupancy(StageStats *st, int count, int size) {
+  if (st->puts++ % OCCUPANCY_SAMPLE == 0) {
+    int bucket = (long long) count * OCCUPANCY_BUCKETS / (size + 1);
+    st->occupancy[bucket]++;
+  }
+}
+
+/**
+ * Write the name of the thread `st` belongs to into `name`.
+ */
+void stats_name(StageStats *st, char *name, int size) {
+  if (st->index > 0) {
+    snprintf(name, size, "%s[%d]", st->name, st->index);
+  } else {
+    snprintf(name, size, "%s", st->name);
+  }
+}
+
+/**
+ * Print the profiling counters of the first `n` threads with the
+ * IPC and the misses per character, or `-` where a counter is
+ * not available. Prints nothing if no counter could be opened.
+ */
+void stats_print_perf(FILE *out, int n) {
+  int opened = 0;
+  for (int i = 0; i < n; i++) {
+    for (unsigned e = 0; e < PERF_EVENTS; e++) {
+      opened |= stage_stats[i].perf_fd[e] >= 0;
+    }
+  }
+  if (!opened) {
+    return;
+  }
+  fprintf(out, "%-14s", "thread");
+  for (unsigned e = 0; e < PERF_EVENTS; e++) {
+    fprintf(out, " %16s", perf_events[e].name);
+  }
+  fprintf(out, " %6s %12s %12s\n", "IPC", "cmiss/char", "bmiss/char");
+  for (int i = 0; i < n; i++) {
+    StageStats *st = &stage_stats[i];
+    unsigned long long value[PERF_EVENTS];
+    int ok[PERF_EVENTS];
+    char name[32];
+    stats_name(st, name, sizeof(name));
+    fprintf(out, "%-14s", name);
+    for (unsigned e = 0; e < PERF_EVENTS; e++) {
+      ok[e] = stats_perf_read(st, e, &value[e]) == 0;
+      if (ok[e]) {
+        fprintf(out, " %16llu", value[e]);
+      } else {
+        fprintf(out, " %16s", "-");
+      }
+    }
+    if (ok[0] && ok[1] && value[0] > 0) {
+      fprintf(out, " %6.2f", (double) value[1] / value[0]);
+    } else {
+      fprintf(out, " %6s", "-");
+    }
+    for (unsigned e = 2; e <= 3; e++) {
+      if (ok[e] && st->chars > 0) {
+        fprintf(out, " %12.4f", (double) value[e] / st->chars);
+      } else {
+        fprintf(out, " %12s", "-");
+      }
+    }
+    fprintf(out, "\n");
+  }
+}
+
+/**
+ * Print every thread's statistics to `out`. The counters are read
+ * while the threads run, so a report taken mid-run is approximate.
+ */
+void stats_print(FILE *out) {
+  int n = atomic_load(&stats_count);
+  if (n > STATS_MAX) {
+    n = STATS_MAX;
+  }
+  double elapsed = (stats_now() - stats_start) / 1e9;
+  fprintf(out, "Stage statistics after %.3f s:\n", elapsed);
+  fprintf(out, "%-14s %14s %10s %10s %11s %10s\n", "thread", "chars", "spans",
+          "MB/s", "buffer ms", "reset ms");
+  for (int i = 0; i < n; i++) {
+    StageStats *st = &stage_stats[i];
+    char name[32];
+    stats_name(st, name, sizeof(name));
+    fprintf(out, "%-14s %14llu %10llu %10.2f %11.2f %10.2f\n", name, st->chars, st->spans,
+            elapsed > 0 ? st->chars / elapsed / 1e6 : 0.0, st->buffer_ns / 1e6, st->reset_ns / 1e6);
+  }
+  for (int i = 0; i < n; i++) {
+    StageStats *st = &stage_stats[i];
+    unsigned long long samples = 0;
+    for (int b = 0; b < OCCUPANCY_BUCKETS; b++) {
+      samples += st->occupancy[b];
+    }
+    if (samples == 0) {
+      continue;
+    }
+    char name[32];
+    stats_name(st, name, sizeof(name));
+    fprintf(out, "%s buffer occupancy %%:", name);
+    for (int b = 0; b < OCCUPANCY_BUCKETS; b++) {
+      fprintf(out, " %d-%d:%.1f", b * 100 / OCCUPANCY_BUCKETS, (b + 1) * 100 / OCCUPANCY_BUCKETS,
+              100.0 * st->occupancy[b] / samples);
+    }
+    fprintf(out, "\n");
+  }
+  if (stats_perf) {
+    stats_print_perf(out, n);
+  }
+  fflush(out);
+}
+
+/**
+ * Body of the thread started by `stats_init` to print the stats
+ * on standard error whenever SIGUSR1 arrives.
+ */
+void *stats_signal_thread(void *arg) {
+  sigset_t *set = arg;
+  int sig;
+  while (sigwait(set, &sig) == 0) {
+    stats_print(stderr);
+  }
+  return 0;
+}
+
+/**
+ * Start the clock and the SIGUSR1 thread. Must be called before
+ * any other thread is created, since it blocks SIGUSR1 in the
+ * calling thread for every thread started after it to inherit.
+ */
+void stats_init() {
+  static sigset_t set;
+  pthread_t thread;
+  stats_start = stats_now();
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  pthread_create(&thread, NULL, &stats_signal_thread, &set);
+  pthread_detach(thread);
+}
+
+#endif // STAGE_STATS_H
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Launches N independent encrypt pipelines at the same time on one
+# host and reports their aggregate throughput. Each instance gets
+# its own output and log file; a run fails if any instance exits
+# with an error or logs a different number of characters than it read.
+#
+# Usage: ./stress.sh [instances] [bytes per instance] [buffer size]
+
+N=${1:-8}
+SIZE=${2:-1048576}
+BUF=${3:-4096}
+
+cd "$(dirname "$0")" || exit 1
+
+# ./encrypt exits with status 1 and a usage message when given no files;
+# 126 or 127 means it cannot be run here (missing, or built for another
+# platform), so build it first
+runnable() {
+  ./encrypt < /dev/null > /dev/null 2>&1
+  [ $? -lt 126 ]
+}
+if ! runnable; then
+  echo "./encrypt cannot run on this host, building it with make build"
+  if ! make -s build || ! runnable; then
+    echo "stress.sh: ./encrypt could not be built for this host" >&2
+    exit 1
+  fi
+fi
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+base64 -w 76 /dev/urandom | head -c "$SIZE" > "$dir/in.txt"
+
+start=$(date +%s.%N)
+i=1
+while [ "$i" -le "$N" ]; do
+  (printf '%s\n%s\n' "$BUF" "$BUF" | ./encrypt "$dir/in.txt" "$dir/out.$i" "$dir/log.$i" > /dev/null
+   echo $? > "$dir/status.$i") &
+  i=$((i + 1))
+done
+wait
+end=$(date +%s.%N)
+
+failed=0
+i=1
+while [ "$i" -le "$N" ]; do
+  counted=$(awk '/^Total input count:/ { total += $4 } END { print total + 0 }' "$dir/log.$i")
+  written=$(wc -c < "$dir/out.$i")
+  if [ "$(cat "$dir/status.$i")" != 0 ] || [ "$counted" != "$SIZE" ] || [ "$written" != "$SIZE" ]; then
+    echo "instance $i failed: status $(cat "$dir/status.$i"), counted $counted, wrote $written of $SIZE"
+    failed=$((failed + 1))
+  fi
+  i=$((i + 1))
+done
+
+awk -v n="$N" -v size="$SIZE" -v t0="$start" -v t1="$end" -v failed="$failed" 'BEGIN {
+  secs = t1 - t0
+  printf "instances=%d bytes_each=%d seconds=%.3f aggregate_MBps=%.2f failed=%d\n",
+         n, size, secs, n * size / secs / 1e6, failed
+}'
+[ "$failed" -eq 0 ]
@@ -0,0 +1,160 @@
+/**********************************************************
+ * This header records a timeline of what the threads do  *
+ * (work on a span, waits on the buffers and on a reset,  *
+ * reset requests and log writes) and writes it out in    *
+ * the Chrome trace event format, for viewing in          *
+ * chrome://tracing or Perfetto. Every thread writes its  *
+ * events to a ring of its own without any locking, and   *
+ * the rings are only read by `trace_dump` once the       *
+ * threads are done. While tracing is off each event      *
+ * costs a single check of `trace_enabled`.               *
+ **********************************************************/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/**
+ * Events kept per thread; older ones are overwritten.
+ */
+#define TRACE_EVENTS (1 << 16)
+#define TRACE_THREADS 64
+
+/**
+ * One event: `phase` is 'B' or 'E' for the start or end of
+ * `name`, or 'i' for an instant. `name` must be a string literal.
+ */
+typedef struct {
+  const char *name;
+  unsigned long long ns;
+  char phase;
+} TraceEvent;
+
+/**
+ * The events of one thread. `count` is the number written so far,
+ * and event `i` is at `events[i % TRACE_EVENTS]`.
+ */
+typedef struct {
+  const char *name;
+  int index;
+  unsigned long long count;
+  TraceEvent events[TRACE_EVENTS];
+} TraceRing;
+
+int trace_enabled;
+TraceRing *trace_rings[TRACE_THREADS];
+atomic_int trace_ring_count;
+_Thread_local TraceRing *trace_ring;
+
+unsigned long long trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Give the calling thread a ring, named `name` (and `index`, to
+ * tell apart threads with the same name) in the trace. Threads
+ * beyond TRACE_THREADS are not traced.
+ */
+void trace_thread(const char *name, int index) {
+  if (!trace_enabled || trace_ring != NULL) {
+    return;
+  }
+  int i = atomic_fetch_add(&trace_ring_count, 1);
+  if (i >= TRACE_THREADS) {
+    return;
+  }
+  TraceRing *ring = malloc(sizeof(TraceRing));
+  ring->name = name;
+  ring->index = index;
+  ring->count = 0;
+  trace_rings[i] = ring;
+  trace_ring = ring;
+}
+
+/**
+ * Record an event for the calling thread, giving it a ring first
+ * if it has none (for threads the driver does not start).
+ */
+void trace_event(const char *name, char phase) {
+  if (!trace_enabled) {
+    return;
+  }
+  if (trace_ring == NULL) {
+    trace_thread("module", 0);
+    if (trace_ring == NULL) {
+      return;
+    }
+  }
+  TraceEvent *ev = &trace_ring->events[trace_ring->count % TRACE_EVENTS];
+  ev->name = name;
+  ev->phase = phase;
+  ev->ns = trace_now();
+  trace_ring->count++;
+}
+
+void trace_begin(const char *name) {
+  trace_event(name, 'B');
+}
+
+void trace_end(const char *name) {
+  trace_event(name, 'E');
+}
+
+void trace_instant(const char *name) {
+  trace_event(name, 'i');
+}
+
+/**
+ * Write every thread's events to `path` as Chrome trace event
+ * JSON, with timestamps in microseconds from the first event.
+ * Must only be called once the traced threads have finished.
+ * Returns 0 on success or -1 if the file cannot be written.
+ */
+int trace_dump(const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    return -1;
+  }
+  int rings = atomic_load(&trace_ring_count);
+  if (rings > TRACE_THREADS) {
+    rings = TRACE_THREADS;
+  }
+
+  unsigned long long origin = ~0ULL;
+  for (int r = 0; r < rings; r++) {
+    TraceRing *ring = trace_rings[r];
+    unsigned long long first = ring->count > TRACE_EVENTS ? ring->count - TRACE_EVENTS : 0;
+    if (ring->count > first && ring->events[first % TRACE_EVENTS].ns < origin) {
+      origin = ring->events[first % TRACE_EVENTS].ns;
+    }
+  }
+
+  fprintf(out, "{\"traceEvents\":[\n");
+  const char *sep = "";
+  for (int r = 0; r < rings; r++) {
+    TraceRing *ring = trace_rings[r];
+    if (ring->index > 0) {
+      fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+              "\"args\":{\"name\":\"%s[%d]\"}}", sep, r, ring->name, ring->index);
+    } else {
+      fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+              "\"args\":{\"name\":\"%s\"}}", sep, r, ring->name);
+    }
+    sep = ",\n";
+    unsigned long long first = ring->count > TRACE_EVENTS ? ring->count - TRACE_EVENTS : 0;
+    for (unsigned long long i = first; i < ring->count; i++) {
+      TraceEvent *ev = &ring->events[i % TRACE_EVENTS];
+      fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f%s}", sep,
+              ev->name, ev->phase, r, (ev->ns - origin) / 1e3, ev->phase == 'i' ? ",\"s\":\"t\"" : "");
+    }
+  }
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0 ? 0 : -1;
+}
+
+#endif // TRACE_H
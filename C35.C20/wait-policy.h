@@ -0,0 +1,154 @@
+/**********************************************************
+ * This header defines the wait policy shared by the      *
+ * circular buffers and the reset controller. A wait      *
+ * spins with a pause hint, then yields the CPU, then     *
+ * parks the thread (futex or condition variable). The    *
+ * budgets come from a policy chosen at startup, and the  *
+ * adaptive policy tunes each wait site's spin budget to  *
+ * the waits it has observed.                             *
+ **********************************************************/
+#ifndef WAIT_POLICY_H
+#define WAIT_POLICY_H
+
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#define encrypt encrypt_unistd
+#include <unistd.h>
+#undef encrypt
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/**
+ * A named set of budgets. `spin` is the number of pause
+ * instructions before yielding (the starting budget when
+ * `adaptive` is set, which then moves between `spin_min` and
+ * `spin_max`), and `yields` the number of `sched_yield` calls
+ * before parking.
+ */
+typedef struct {
+  const char *name;
+  int spin;
+  int yields;
+  int adaptive;
+  int spin_min;
+  int spin_max;
+} WaitPolicy;
+
+/**
+ * Policies selectable with `-w`: `park` sleeps immediately
+ * (the old behaviour), `spin` keeps a long fixed spin for
+ * latency-sensitive runs with spare cores, `yield` skips spinning
+ * for core-constrained runs, and `adaptive` learns the spin budget.
+ */
+WaitPolicy wait_policies[] = {
+  { "adaptive", 256, 4, 1, 16, 1 << 14 },
+  { "park", 0, 0, 0, 0, 0 },
+  { "spin", 1 << 12, 16, 0, 0, 0 },
+  { "yield", 0, 64, 0, 0, 0 },
+};
+
+WaitPolicy *wait_policy = &wait_policies[0];
+
+/**
+ * Select the policy called `name`. Returns 0 on success or -1
+ * if there is no such policy.
+ */
+int wait_policy_select(const char *name) {
+  for (unsigned i = 0; i < sizeof(wait_policies) / sizeof(wait_policies[0]); i++) {
+    if (strcmp(wait_policies[i].name, name) == 0) {
+      wait_policy = &wait_policies[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Per wait site state, owned by the single thread that waits
+ * there. `budget` is the current spin budget and `round` counts
+ * the steps taken by the wait in progress.
+ */
+typedef struct {
+  int budget;
+  int round;
+} WaitState;
+
+void ws_init(WaitState *ws) {
+  ws->budget = wait_policy->spin;
+  ws->round = 0;
+}
+
+/**
+ * Take one step of the wait in progress: a pause while within
+ * the spin budget, then a yield. Returns 1 without waiting once
+ * both budgets are used up and the caller should park.
+ */
+int ws_step(WaitState *ws) {
+  if (ws->round < ws->budget) {
+    ws->round++;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+    return 0;
+  }
+  if (ws->round < ws->budget + wait_policy->yields) {
+    ws->round++;
+    sched_yield();
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Finish the wait in progress. With the adaptive policy a wait
+ * that ended while spinning makes room for twice as many spins,
+ * and one that had to yield or park halves the budget.
+ */
+void ws_done(WaitState *ws) {
+  if (wait_policy->adaptive) {
+    if (ws->round > 0 && ws->round <= ws->budget) {
+      int want = ws->round * 2;
+      if (want > ws->budget) {
+        ws->budget = want < wait_policy->spin_max ? want : wait_policy->spin_max;
+      }
+    } else if (ws->round > ws->budget) {
+      ws->budget /= 2;
+      if (ws->budget < wait_policy->spin_min) {
+        ws->budget = wait_policy->spin_min;
+      }
+    }
+  }
+  ws->round = 0;
+}
+
+/**
+ * Park the calling thread while `*word` still equals `seen`.
+ * Without futexes this degrades to a yield.
+ */
+void wp_park(atomic_uint *word, unsigned seen) {
+#ifdef __linux__
+  syscall(SYS_futex, (unsigned *) word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+  if (atomic_load(word) == seen) {
+    sched_yield();
+  }
+#endif
+}
+
+/**
+ * Bump `*word` and wake every thread parked on it.
+ */
+void wp_wake(atomic_uint *word) {
+  atomic_fetch_add(word, 1);
+#ifdef __linux__
+  syscall(SYS_futex, (unsigned *) word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+#endif // WAIT_POLICY_H
@@ -0,0 +1,198 @@
+/**********************************************************
+ * This header defines a fixed pool of worker threads     *
+ * with work stealing. Every worker has its own deque of  *
+ * tasks: it pushes and pops the tasks it creates at the  *
+ * bottom, so related work stays on one thread, and when  *
+ * its deque is empty it steals the oldest task from the  *
+ * top of another worker's deque. The pool runs until     *
+ * every task, including those created by other tasks,    *
+ * has finished; idle workers sleep until a task is      *
+ * pushed.                                                *
+ **********************************************************/
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct PoolTask PoolTask;
+typedef struct WorkPool WorkPool;
+
+/**
+ * A task is embedded at the start of a struct holding its
+ * arguments; `run` is called with the task and the index of the
+ * worker running it, and owns the task from then on.
+ */
+struct PoolTask {
+  void (*run)(PoolTask *task, WorkPool *pool, int worker);
+};
+
+/**
+ * One worker's deque: the tasks in `tasks[top..bottom)`, oldest
+ * first, growing as needed.
+ */
+typedef struct {
+  _Alignas(64) pthread_mutex_t mutex;
+  PoolTask **tasks;
+  int capacity;
+  int top;
+  int bottom;
+} PoolDeque;
+
+/**
+ * `pending` counts the tasks pushed and not yet finished, and
+ * `queued` those still in a deque. Idle workers wait on `idle`.
+ */
+struct WorkPool {
+  int workers;
+  PoolDeque *deques;
+  atomic_long pending;
+  atomic_long queued;
+  pthread_mutex_t idle_mutex;
+  pthread_cond_t idle;
+  void (*start)(int worker);
+};
+
+typedef struct {
+  WorkPool *pool;
+  int worker;
+} PoolWorker;
+
+/**
+ * Push `task` onto the bottom of `worker`'s deque. Tasks may push
+ * further tasks while the pool runs. Returns 0, or -1 (leaving the
+ * task to the caller) if the deque cannot grow.
+ */
+int pool_push(WorkPool *pool, int worker, PoolTask *task) {
+  PoolDeque *d = &pool->deques[worker];
+  atomic_fetch_add(&pool->pending, 1);
+  pthread_mutex_lock(&d->mutex);
+  if (d->bottom == d->capacity) {
+    int used = d->bottom - d->top;
+    if (used * 2 > d->capacity || d->capacity == 0) {
+      int capacity = d->capacity ? d->capacity * 2 : 64;
+      PoolTask **tasks = realloc(d->tasks, capacity * sizeof(PoolTask *));
+      if (tasks == NULL) {
+        pthread_mutex_unlock(&d->mutex);
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+      }
+      d->tasks = tasks;
+      d->capacity = capacity;
+    }
+    for (int i = 0; i < used; i++) {
+      d->tasks[i] = d->tasks[d->top + i];
+    }
+    d->top = 0;
+    d->bottom = used;
+  }
+  // Counted before it is visible, so a thief never takes `queued`
+  // below zero
+  atomic_fetch_add(&pool->queued, 1);
+  d->tasks[d->bottom++] = task;
+  pthread_mutex_unlock(&d->mutex);
+  pthread_mutex_lock(&pool->idle_mutex);
+  pthread_cond_signal(&pool->idle);
+  pthread_mutex_unlock(&pool->idle_mutex);
+  return 0;
+}
+
+/**
+ * Take the newest task from the bottom of the worker's own deque,
+ * or the oldest from the top of another's, or NULL if none is queued.
+ */
+PoolTask *pool_take(WorkPool *pool, int worker) {
+  PoolDeque *d = &pool->deques[worker];
+  PoolTask *task = NULL;
+  pthread_mutex_lock(&d->mutex);
+  if (d->bottom > d->top) {
+    task = d->tasks[--d->bottom];
+  }
+  pthread_mutex_unlock(&d->mutex);
+  for (int i = 1; task == NULL && i < pool->workers; i++) {
+    PoolDeque *victim = &pool->deques[(worker + i) % pool->workers];
+    pthread_mutex_lock(&victim->mutex);
+    if (victim->bottom > victim->top) {
+      task = victim->tasks[victim->top++];
+    }
+    pthread_mutex_unlock(&victim->mutex);
+  }
+  if (task != NULL) {
+    atomic_fetch_sub(&pool->queued, 1);
+  }
+  return task;
+}
+
+void *pool_worker(void *arg) {
+  PoolWorker *w = arg;
+  WorkPool *pool = w->pool;
+  if (pool->start) {
+    pool->start(w->worker);
+  }
+  while (atomic_load(&pool->pending) > 0) {
+    PoolTask *task = pool_take(pool, w->worker);
+    if (task == NULL) {
+      // Everything left is running; one of those may still push more
+      pthread_mutex_lock(&pool->idle_mutex);
+      while (atomic_load(&pool->pending) > 0 && atomic_load(&pool->queued) == 0) {
+        pthread_cond_wait(&pool->idle, &pool->idle_mutex);
+      }
+      pthread_mutex_unlock(&pool->idle_mutex);
+      continue;
+    }
+    task->run(task, pool, w->worker);
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+      pthread_mutex_lock(&pool->idle_mutex);
+      pthread_cond_broadcast(&pool->idle);
+      pthread_mutex_unlock(&pool->idle_mutex);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Set up a pool of `workers` threads, calling `start` (if not NULL)
+ * in each as it starts. Push the first tasks with `pool_push`, then
+ * run them with `pool_run`.
+ */
+void pool_init(WorkPool *pool, int workers, void (*start)(int worker)) {
+  pool->workers = workers;
+  pool->deques = calloc(workers, sizeof(PoolDeque));
+  for (int i = 0; i < workers; i++) {
+    pthread_mutex_init(&pool->deques[i].mutex, NULL);
+  }
+  atomic_init(&pool->pending, 0);
+  atomic_init(&pool->queued, 0);
+  pthread_mutex_init(&pool->idle_mutex, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->start = start;
+}
+
+/**
+ * Start the workers, wait until every task has finished and free
+ * the pool's deques.
+ */
+void pool_run(WorkPool *pool) {
+  pthread_t *threads = malloc(pool->workers * sizeof(pthread_t));
+  PoolWorker *args = malloc(pool->workers * sizeof(PoolWorker));
+  for (int i = 0; i < pool->workers; i++) {
+    args[i].pool = pool;
+    args[i].worker = i;
+    pthread_create(&threads[i], NULL, &pool_worker, &args[i]);
+  }
+  for (int i = 0; i < pool->workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < pool->workers; i++) {
+    pthread_mutex_destroy(&pool->deques[i].mutex);
+    free(pool->deques[i].tasks);
+  }
+  free(pool->deques);
+  pthread_mutex_destroy(&pool->idle_mutex);
+  pthread_cond_destroy(&pool->idle);
+  free(threads);
+  free(args);
+}
+
+#endif // WORK_POOL_H